@@ -2,40 +2,143 @@
 
 #include "SoundTools.hpp"
 
-double WaveSaw(double t, int n)
+#include <bit>
+#include <complex>
+#include <condition_variable>
+#include <mutex>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// 倍音スペクトル
+// k番目の要素がk次倍音の係数で、実部がcos成分、虚部がsin成分（0番目は直流成分）
+using HarmonicSpectrum = Array<std::complex<double>>;
+
+HarmonicSpectrum SawSpectrum(size_t harmonicCount)
+{
+	HarmonicSpectrum spectrum(harmonicCount + 1);
+	for (size_t k = 1; k <= harmonicCount; ++k)
+	{
+		const double a = (k % 2 == 0 ? -2.0 : 2.0) / (Math::Pi * k);
+		spectrum[k] = { 0.0, a };
+	}
+
+	return spectrum;
+}
+
+HarmonicSpectrum SquareSpectrum(size_t harmonicCount)
+{
+	HarmonicSpectrum spectrum(harmonicCount + 1);
+	for (size_t k = 1; k <= harmonicCount; k += 2)
+	{
+		spectrum[k] = { 0.0, 4.0 / (Math::Pi * k) };
+	}
+
+	return spectrum;
+}
+
+HarmonicSpectrum PulseSpectrum(size_t harmonicCount, double d)
 {
-	double sum = 0;
-	for (int k = 1; k <= n; ++k)
+	HarmonicSpectrum spectrum(harmonicCount + 1);
+	spectrum[0] = { 2.0 * d - 1.0, 0.0 };
+	for (size_t k = 1; k <= harmonicCount; ++k)
 	{
-		const double a = (k % 2 == 0 ? 1.0 : -1.0) / k;
-		sum += a * sin(k * t);
+		const double a = 4.0 * sin(k * d * Math::Pi) / (Math::Pi * k);
+		spectrum[k] = { a * cos(k * d * Math::Pi), a * sin(k * d * Math::Pi) };
 	}
 
-	return -2.0 * sum / Math::Pi;
+	return spectrum;
+}
+
+HarmonicSpectrum SinSpectrum()
+{
+	return { { 0.0, 0.0 }, { 0.0, 1.0 } };
 }
 
-double WaveSquare(double t, int n)
+// 要素数が2の累乗の複素数列を逆FFTする（1/Nの正規化はしない）
+void InverseFFT(Array<std::complex<double>>& data)
 {
-	double sum = 0;
-	for (int k = 1; k <= n; ++k)
+	const size_t n = data.size();
+	assert(std::has_single_bit(n));
+
+	for (size_t i = 1, j = 0; i < n; ++i)
+	{
+		size_t bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+		{
+			j ^= bit;
+		}
+		j ^= bit;
+
+		if (i < j)
+		{
+			std::swap(data[i], data[j]);
+		}
+	}
+
+	// 回転因子は段ごとに掛け合わせず、誤差が溜まらないように先に表にしておく
+	Array<std::complex<double>> twiddles(n / 2);
+	for (size_t i = 0; i < twiddles.size(); ++i)
 	{
-		const double a = 2.0 * k - 1.0;
-		sum += sin(a * t) / a;
+		twiddles[i] = std::polar(1.0, 2_pi * i / n);
 	}
 
-	return 4.0 * sum / Math::Pi;
+	for (size_t length = 2; length <= n; length <<= 1)
+	{
+		const size_t half = length / 2;
+		const size_t step = n / length;
+		for (size_t i = 0; i < n; i += length)
+		{
+			for (size_t j = 0; j < half; ++j)
+			{
+				const auto u = data[i + j];
+				const auto v = data[i + j + half] * twiddles[j * step];
+				data[i + j] = u + v;
+				data[i + j + half] = u - v;
+			}
+		}
+	}
 }
 
-double WavePulse(double t, int n, double d)
+// スペクトルのmaxHarmonic次までを1周期分の波形にする
+// 要素数が2の累乗なら逆FFTで、そうでなければ倍音を直接足し合わせる
+void SynthesizeSpectrum(const HarmonicSpectrum& spectrum, size_t maxHarmonic, std::span<float> wave)
 {
-	double sum = 0;
-	for (int k = 1; k <= n; ++k)
+	const size_t n = wave.size();
+	maxHarmonic = Min(maxHarmonic, spectrum.size() - 1);
+
+	if (std::has_single_bit(n) && maxHarmonic < n / 2)
 	{
-		const double a = sin(k * d * Math::Pi) / k;
-		sum += a * cos(k * (t - d * Math::Pi));
+		// a cos + b sin = Re((a - ib) e^{iθ}) なので、正と負の周波数に半分ずつ置く
+		Array<std::complex<double>> bins(n);
+		bins[0] = spectrum[0].real();
+		for (size_t k = 1; k <= maxHarmonic; ++k)
+		{
+			const auto c = std::conj(spectrum[k]) * 0.5;
+			bins[k] = c;
+			bins[n - k] = std::conj(c);
+		}
+
+		InverseFFT(bins);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			wave[i] = static_cast<float>(bins[i].real());
+		}
+		return;
 	}
 
-	return 2.0 * d - 1.0 + 4.0 * sum / Math::Pi;
+	for (size_t i = 0; i < n; ++i)
+	{
+		const double angle = 2_pi * i / n;
+		double sum = spectrum[0].real();
+		for (size_t k = 1; k <= maxHarmonic; ++k)
+		{
+			sum += spectrum[k].real() * cos(k * angle) + spectrum[k].imag() * sin(k * angle);
+		}
+		wave[i] = static_cast<float>(sum);
+	}
 }
 
 double WaveNoise()
@@ -56,71 +159,149 @@ class OscillatorWavetable
 {
 public:
 
+	// 補間で末尾から先頭に折り返さずに済むように、1周期分の後ろに先頭のサンプルを複製しておく数
+	// （位相がちょうど 2π のときに1周期分の位置とその次を読むので2つ）
+	static constexpr size_t GuardSize = 2;
+
 	OscillatorWavetable() = default;
 
 	OscillatorWavetable(size_t resolution, double frequency, WaveForm waveType) :
-		m_wave(resolution),
+		m_wave(resolution + GuardSize),
+		m_view(m_wave.data(), resolution),
 		m_xToIndex(resolution / 2_pi)
 	{
-		const int mSaw = static_cast<int>(MaxFreq / frequency);
-		const int mSquare = static_cast<int>((MaxFreq + frequency) / (frequency * 2.0));
+		Generate(m_wave, frequency, waveType);
+	}
 
-		for (size_t i = 0; i < resolution; ++i)
-		{
-			const double angle = 2_pi * i / resolution;
+	// 任意の倍音スペクトルから、frequencyで折り返さない次数までを使ってテーブルを作る
+	OscillatorWavetable(size_t resolution, double frequency, const HarmonicSpectrum& spectrum) :
+		m_wave(resolution + GuardSize),
+		m_view(m_wave.data(), resolution),
+		m_xToIndex(resolution / 2_pi)
+	{
+		Generate(m_wave, frequency, spectrum);
+	}
+
+	// 外部のメモリ（バンク全体の領域やメモリマップしたファイルなど）をそのまま参照する
+	// waveの直後にGuardSize個のガードサンプルが続いていて、このテーブルより長く生存していなければならない
+	explicit OscillatorWavetable(std::span<const float> wave) :
+		m_view(wave),
+		m_xToIndex(wave.size() / 2_pi)
+	{
+	}
 
-			switch (waveType)
+	// m_viewがm_waveを指すので、コピーはせずムーブだけ許す（ムーブではバッファのアドレスが変わらない）
+	OscillatorWavetable(OscillatorWavetable&&) = default;
+	OscillatorWavetable& operator=(OscillatorWavetable&&) = default;
+
+	// wave の末尾 GuardSize 個を除いた範囲に1周期分の波形を作り、末尾をガードサンプルで埋める
+	static void Generate(std::span<float> wave, double frequency, WaveForm waveType)
+	{
+		const auto resolution = wave.size() - GuardSize;
+		if (waveType == WaveForm::Noise)
+		{
+			for (auto& sample : wave.first(resolution))
 			{
-			case WaveForm::Saw:
-				m_wave[i] = static_cast<float>(WaveSaw(angle, mSaw));
-				break;
-			case WaveForm::Sin:
-				m_wave[i] = static_cast<float>(sin(angle));
-				break;
-			case WaveForm::Square:
-				m_wave[i] = static_cast<float>(WaveSquare(angle, mSquare));
-				break;
-			case WaveForm::Noise:
-				m_wave[i] = static_cast<float>(WaveNoise());
-				break;
-			default: break;
+				sample = static_cast<float>(WaveNoise());
 			}
+			FillGuard(wave);
+			return;
 		}
+
+		Generate(wave, frequency, MakeSpectrum(waveType, resolution / 2 - 1));
 	}
 
-	double get(double x) const
+	static void Generate(std::span<float> wave, double frequency, const HarmonicSpectrum& spectrum)
 	{
-		auto indexFloat = x * m_xToIndex;
-		auto prevIndex = static_cast<size_t>(indexFloat);
-		if (m_wave.size() == prevIndex)
-		{
-			prevIndex -= m_wave.size();
-			indexFloat -= m_wave.size();
-		}
-		auto nextIndex = prevIndex + 1;
-		if (m_wave.size() == nextIndex)
+		const auto resolution = wave.size() - GuardSize;
+		SynthesizeSpectrum(spectrum, MaxHarmonic(resolution, frequency), wave.first(resolution));
+		FillGuard(wave);
+	}
+
+	// frequencyで鳴らしたときにナイキスト周波数を超えず、テーブル自体でも折り返さない最大の次数
+	static size_t MaxHarmonic(size_t resolution, double frequency)
+	{
+		return Min(static_cast<size_t>(MaxFreq / frequency), resolution / 2 - 1);
+	}
+
+	static HarmonicSpectrum MakeSpectrum(WaveForm waveType, size_t harmonicCount)
+	{
+		switch (waveType)
 		{
-			nextIndex = 0;
+		case WaveForm::Saw: return SawSpectrum(harmonicCount);
+		case WaveForm::Square: return SquareSpectrum(harmonicCount);
+		default: return SinSpectrum();
 		}
-		const auto x01 = indexFloat - prevIndex;
-		return Math::Lerp(m_wave[prevIndex], m_wave[nextIndex], x01);
+	}
+
+	// x は [0, 2π] の範囲であること
+	// 末尾にガードサンプルがあるので折り返しの分岐は要らない
+	double get(double x) const
+	{
+		const auto indexFloat = x * m_xToIndex;
+		const auto index = static_cast<size_t>(indexFloat);
+		const auto x01 = indexFloat - index;
+		const float* wave = m_view.data();
+		return Math::Lerp(wave[index], wave[index + 1], x01);
+	}
+
+	// 1周期分の先頭（直後にGuardSize個のガードサンプルが続く）
+	const float* data() const
+	{
+		return m_view.data();
+	}
+
+	// ガードサンプルを含まない1周期分のサンプル数
+	size_t size() const
+	{
+		return m_view.size();
+	}
+
+	double xToIndex() const
+	{
+		return m_xToIndex;
 	}
 
 private:
 
+	static void FillGuard(std::span<float> wave)
+	{
+		const auto resolution = wave.size() - GuardSize;
+		for (size_t i = 0; i < GuardSize; ++i)
+		{
+			wave[resolution + i] = wave[i % resolution];
+		}
+	}
+
+	// 自前で作ったテーブルの実体（外部のメモリを参照するときは空）
 	Array<float> m_wave;
+	std::span<const float> m_view;
 	double m_xToIndex = 0;
 };
-
 class BandLimitedWaveTables
 {
 public:
 
 	BandLimitedWaveTables() = default;
 
-	BandLimitedWaveTables(size_t tableCount, size_t waveResolution, WaveForm waveType)
+	// テーブルの実体は初めて使われたときに作る
+	BandLimitedWaveTables(size_t tableCount, size_t waveResolution, WaveForm waveType) :
+		BandLimitedWaveTables(tableCount, waveResolution,
+			waveType == WaveForm::Noise ? HarmonicSpectrum() : OscillatorWavetable::MakeSpectrum(waveType, waveResolution / 2 - 1))
+	{
+	}
+
+	// 任意の倍音スペクトルから帯域ごとに高次の倍音を落としたテーブルを作る
+	// スペクトルが空のときはノイズになる
+	// 全帯域のテーブルは1つの領域にキャッシュラインの境界に揃えて並べる
+	BandLimitedWaveTables(size_t tableCount, size_t waveResolution, HarmonicSpectrum spectrum) :
+		m_waveResolution(waveResolution),
+		m_spectrum(std::move(spectrum)),
+		m_tableStride(TableStride(waveResolution)),
+		m_storage(AllocateStorage(tableCount * TableStride(waveResolution))),
+		m_waveTables(tableCount),
+		m_buildFlags(std::make_unique<std::once_flag[]>(tableCount))
 	{
-		m_waveTables.reserve(tableCount);
 		m_tableFreqs.reserve(tableCount);
 
 		for (size_t i = 0; i < tableCount; ++i)
@@ -128,7 +309,6 @@ public:
 			const double rate = 1.0 * i / tableCount;
 			const double freq = pow(2, Math::Lerp(m_minFreqLog, m_maxFreqLog, rate));
 
-			m_waveTables.emplace_back(waveResolution, freq, waveType);
 			m_tableFreqs.push_back(static_cast<float>(freq));
 		}
 
@@ -144,35 +324,161 @@ public:
 		}
 	}
 
-	double get(double x, double freq) const
+	// 周波数に対応する前後のテーブルと、その間の補間率
+	struct BandSelection
+	{
+		const OscillatorWavetable* prev;
+		const OscillatorWavetable* next;
+		double rate;
+	};
+
+	// 周波数が変わらない間は結果を使い回せるように、テーブルの選択だけを行う
+	// 返すテーブルは構築済みであることが保証される
+	BandSelection selectBand(double freq) const
 	{
 		const auto nextIndex = m_indices[static_cast<int>(freq * m_freqToIndex)];
 		if (nextIndex == 0)
 		{
-			return m_waveTables.front().get(x);
+			const auto& front = table(0);
+			return { &front, &front, 0.0 };
 		}
 		if (static_cast<size_t>(nextIndex) == m_tableFreqs.size())
 		{
-			return m_waveTables.back().get(x);
+			const auto& back = table(m_tableFreqs.size() - 1);
+			return { &back, &back, 0.0 };
 		}
 
 		const auto prevIndex = nextIndex - 1;
 		const auto rate = Math::InvLerp(m_tableFreqs[prevIndex], m_tableFreqs[nextIndex], freq);
-		return Math::Lerp(m_waveTables[prevIndex].get(x), m_waveTables[nextIndex].get(x), rate);
+		return { &table(prevIndex), &table(nextIndex), rate };
+	}
+
+	// ミップマップとして使うときの選択
+	// freq で折り返さないテーブルのうち最も倍音の多いものを1つだけ選ぶ
+	// crossfade が true のときは、帯域の中の位置に応じて1つ上の帯域のテーブルと混ぜて、帯域の境目で音色が飛ばないようにする
+	BandSelection selectMipmap(double freq, bool crossfade) const
+	{
+		const auto nextIndex = m_indices[static_cast<int>(freq * m_freqToIndex)];
+		const auto index = Min<size_t>(nextIndex, m_tableFreqs.size() - 1);
+		const auto& current = table(index);
+		if (!crossfade || nextIndex == 0 || index + 1 == m_tableFreqs.size())
+		{
+			return { &current, &current, 0.0 };
+		}
+
+		const auto rate = Math::InvLerp(m_tableFreqs[index - 1], m_tableFreqs[index], freq);
+		return { &current, &table(index + 1), rate };
+	}
+
+	double get(double x, const BandSelection& band) const
+	{
+		return Math::Lerp(band.prev->get(x), band.next->get(x), band.rate);
+	}
+
+	double get(double x, double freq) const
+	{
+		return get(x, selectBand(freq));
+	}
+
+	size_t tableCount() const
+	{
+		return m_waveTables.size();
+	}
+
+	// index番目のテーブルを返す（未構築ならここで作る）
+	// 複数のスレッドから同時に呼ばれても構築は一度だけ行われる
+	const OscillatorWavetable& table(size_t index) const
+	{
+		std::call_once(m_buildFlags[index], [&]
+			{
+				const std::span<float> wave(m_storage.get() + m_tableStride * index, m_waveResolution + OscillatorWavetable::GuardSize);
+				if (m_spectrum.isEmpty())
+				{
+					OscillatorWavetable::Generate(wave, m_tableFreqs[index], WaveForm::Noise);
+				}
+				else
+				{
+					OscillatorWavetable::Generate(wave, m_tableFreqs[index], m_spectrum);
+				}
+
+				m_waveTables[index] = OscillatorWavetable(wave.first(m_waveResolution));
+				++m_builtCount;
+			});
+
+		return m_waveTables[index];
+	}
+
+	size_t builtCount() const
+	{
+		return m_builtCount;
+	}
+
+	size_t waveResolution() const
+	{
+		return m_waveResolution;
+	}
+
+	// 隣り合うテーブルの先頭の間隔（ガードサンプルと境界を揃えるための詰め物を含む）
+	size_t tableStride() const
+	{
+		return m_tableStride;
+	}
+
+	static size_t TableStride(size_t waveResolution)
+	{
+		const size_t floatsPerLine = TableAlignment / sizeof(float);
+		return (waveResolution + OscillatorWavetable::GuardSize + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+	}
+
+	static constexpr size_t TableAlignment = 64;
+
+	// index番目のテーブルとして外部のメモリを使う（後ろにガードサンプルが必要）
+	// 既に構築済みならそちらを使い続ける
+	void attach(size_t index, std::span<const float> wave) const
+	{
+		std::call_once(m_buildFlags[index], [&]
+			{
+				m_waveTables[index] = OscillatorWavetable(wave);
+				++m_builtCount;
+			});
 	}
 
 private:
 
 	double m_minFreqLog = log2(MinFreq);
 	double m_maxFreqLog = log2(MaxFreq);
-	Array<OscillatorWavetable> m_waveTables;
+	size_t m_waveResolution = 0;
+	HarmonicSpectrum m_spectrum;
+
+	// 要素のアドレスはselectBandの結果として外に渡るので、構築後にサイズを変えないこと
+	struct AlignedDeleter
+	{
+		void operator()(float* p) const
+		{
+			::operator delete(p, std::align_val_t{ TableAlignment });
+		}
+	};
+
+	static std::unique_ptr<float[], AlignedDeleter> AllocateStorage(size_t count)
+	{
+		return std::unique_ptr<float[], AlignedDeleter>(static_cast<float*>(::operator new(sizeof(float) * count, std::align_val_t{ TableAlignment })));
+	}
+
+	size_t m_tableStride = 0;
+
+	// 全帯域のテーブルの実体（帯域ごとにm_tableStride個ずつ並ぶ）
+	std::unique_ptr<float[], AlignedDeleter> m_storage;
+	mutable Array<OscillatorWavetable> m_waveTables;
+	std::unique_ptr<std::once_flag[]> m_buildFlags;
+	mutable std::atomic<size_t> m_builtCount = 0;
 	Array<float> m_tableFreqs;
 
 	Array<uint32> m_indices;
 	double m_freqToIndex = 0;
 };
 
-static Array<BandLimitedWaveTables> OscWaveTables =
+// once_flagを持つためコピーできないので固定長配列で持つ
+static std::array<BandLimitedWaveTables, 4> OscWaveTables =
 {
 	BandLimitedWaveTables(80, 2048, WaveForm::Saw),
 	BandLimitedWaveTables(1, 2048, WaveForm::Sin),
@@ -180,761 +486,3695 @@ static Array<BandLimitedWaveTables> OscWaveTables =
 	BandLimitedWaveTables(1, SamplingFreq, WaveForm::Noise),
 };
 
-const auto SliderHeight = 36;
-const auto SliderWidth = 400;
-const auto LabelWidth = 200;
+// MinFreq から MaxFreq までを1オクターブ弱の間隔で分けたミップマップ用のテーブル
+static constexpr size_t MipmapTableCount = 11;
 
-struct ADSRConfig
+static std::array<BandLimitedWaveTables, 4> OscMipmapTables =
 {
-	double attackTime = 0.01;
-	double decayTime = 0.01;
-	double sustainLevel = 0.6;
-	double sustainResetTime = 0.05;
-	double releaseTime = 0.4;
-
-	void updateGUI(Vec2& pos)
-	{
-		SimpleGUI::Slider(U"attack : {:.2f}"_fmt(attackTime), attackTime, 0.0, 0.5, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-		SimpleGUI::Slider(U"decay : {:.2f}"_fmt(decayTime), decayTime, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-		SimpleGUI::Slider(U"sustain : {:.2f}"_fmt(sustainLevel), sustainLevel, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-		SimpleGUI::Slider(U"release : {:.2f}"_fmt(releaseTime), releaseTime, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-	}
+	BandLimitedWaveTables(MipmapTableCount, 2048, WaveForm::Saw),
+	BandLimitedWaveTables(1, 2048, WaveForm::Sin),
+	BandLimitedWaveTables(MipmapTableCount, 2048, WaveForm::Square),
+	BandLimitedWaveTables(1, SamplingFreq, WaveForm::Noise),
 };
 
-bool SliderInt(const String& label, int& value, double min, double max, const Vec2& pos, double labelWidth = 80.0, double sliderWidth = 120.0, bool enabled = true)
+// ファイルへの書き出しや先読みで扱う全てのテーブル
+Array<const BandLimitedWaveTables*> AllWaveTableBanks()
 {
-	static std::unordered_map<int*, double> val;
-	val[&value] = value;
-	const bool result = SimpleGUI::Slider(label, val[&value], min, max, pos, labelWidth, sliderWidth, enabled);
-	value = static_cast<int>(Math::Round(val[&value]));
-	return result;
+	Array<const BandLimitedWaveTables*> banks;
+	for (const auto& waveTables : OscWaveTables)
+	{
+		banks.push_back(&waveTables);
+	}
+	for (const auto& waveTables : OscMipmapTables)
+	{
+		banks.push_back(&waveTables);
+	}
+	return banks;
 }
 
-class EnvGenerator
+// 全てのウェーブテーブルをファイルに書き出し、起動時にはメモリマップしてそのまま使う
+// 読み取り専用でマップするので、同じファイルを開いた複数のプロセスはページを共有できる
+class WaveTableBankFile
 {
 public:
 
-	enum class State
-	{
-		Attack, Decay, Sustain, Release
-	};
+	static constexpr uint32 Version = 3;
 
-	void noteOff()
+	// 全帯域を構築して書き出す
+	static bool Write(FilePathView path)
 	{
-		if (m_state != State::Release)
+		const auto banks = AllWaveTableBanks();
+
+		Array<BankHeader> bankHeaders;
+		size_t sampleCount = 0;
+		for (const auto* waveTables : banks)
 		{
-			m_prevStateLevel = m_currentLevel;
-			m_elapsed = 0;
-			m_state = State::Release;
+			bankHeaders.push_back({ static_cast<uint32>(waveTables->tableCount()), static_cast<uint32>(waveTables->waveResolution()), static_cast<uint32>(waveTables->tableStride()), 0 });
+			sampleCount += waveTables->tableCount() * waveTables->tableStride();
 		}
-	}
 
-	void reset(State state)
-	{
-		m_prevStateLevel = m_currentLevel;
-		m_elapsed = 0;
-		m_state = state;
-	}
+		const size_t samplesOffset = SamplesOffset(bankHeaders.size());
+		Array<uint8> payload(samplesOffset + sizeof(float) * sampleCount);
+		std::memcpy(payload.data(), bankHeaders.data(), sizeof(BankHeader) * bankHeaders.size());
 
-	void update(const ADSRConfig& adsr, double dt)
-	{
-		switch (m_state)
+		// メモリ上と同じく、ガードサンプルを含めてテーブルごとに境界を揃えて並べる
+		auto* samples = reinterpret_cast<float*>(payload.data() + samplesOffset);
+		for (const auto* waveTables : banks)
 		{
-		case State::Attack: // 0.0 から 1.0 まで attackTime かけて増幅する
-			if (m_elapsed < adsr.attackTime)
+			for (size_t i = 0; i < waveTables->tableCount(); ++i)
 			{
-				m_currentLevel = Math::Lerp(m_prevStateLevel, 1.0, m_elapsed / adsr.attackTime);
-				break;
+				const auto& table = waveTables->table(i);
+				std::memcpy(samples, table.data(), sizeof(float) * (table.size() + OscillatorWavetable::GuardSize));
+				samples += waveTables->tableStride();
 			}
-			m_prevStateLevel = m_currentLevel;
-			m_elapsed -= adsr.attackTime;
-			m_state = State::Decay;
-			[[fallthrough]]; // Decay処理にそのまま続く
+		}
 
-		case State::Decay: // 1.0 から sustainLevel まで decayTime かけて減衰する
-			if (m_elapsed < adsr.decayTime)
-			{
-				m_currentLevel = Math::Lerp(m_prevStateLevel, adsr.sustainLevel, m_elapsed / adsr.decayTime);
-				break;
-			}
-			m_prevStateLevel = m_currentLevel;
-			m_elapsed -= adsr.decayTime;
-			m_state = State::Sustain;
-			[[fallthrough]]; // Sustain処理にそのまま続く
+		Header header = {};
+		std::memcpy(header.magic, "WTBK", 4);
+		header.version = Version;
+		header.samplingFreq = SamplingFreq;
+		header.bankCount = static_cast<uint32>(bankHeaders.size());
+		header.payloadSize = payload.size();
+		header.payloadHash = Hash::XXHash3(payload.data(), payload.size());
+
+		BinaryWriter writer(path);
+		if (!writer)
+		{
+			return false;
+		}
+
+		writer.write(&header, sizeof(header));
+		writer.write(payload.data(), payload.size());
+		return true;
+	}
 
-		case State::Sustain: // ノートオンの間 sustainLevel を維持する
-			if (m_elapsed < adsr.sustainResetTime)
+	// ファイルを検証してから各テーブルにつなぐ
+	// 合わなければ何もせずfalseを返す（その場合テーブルは従来通り使うときに作られる）
+	bool load(FilePathView path, String* errorMessage = nullptr)
+	{
+		const auto fail = [&](const char32* message)
+		{
+			if (errorMessage)
 			{
-				m_currentLevel = Math::Lerp(m_prevStateLevel, adsr.sustainLevel, m_elapsed / adsr.sustainResetTime);
+				*errorMessage = message;
 			}
-			else
+			m_file.reset();
+			return false;
+		};
+
+		m_file = std::make_unique<MemoryMappedFileView>(path);
+		if (!*m_file)
+		{
+			return fail(U"couldn't open file");
+		}
+
+		const auto mapped = m_file->mapAll();
+		const auto* bytes = reinterpret_cast<const uint8*>(mapped.data);
+		if (mapped.size < sizeof(Header))
+		{
+			return fail(U"file is too small");
+		}
+
+		Header header;
+		std::memcpy(&header, bytes, sizeof(header));
+		if (std::memcmp(header.magic, "WTBK", 4) != 0 || header.version != Version)
+		{
+			return fail(U"unknown format");
+		}
+		const auto banks = AllWaveTableBanks();
+		if (header.samplingFreq != SamplingFreq || header.bankCount != banks.size())
+		{
+			return fail(U"bank layout mismatch");
+		}
+		if (mapped.size - sizeof(Header) != header.payloadSize)
+		{
+			return fail(U"size mismatch");
+		}
+
+		const auto* payload = bytes + sizeof(Header);
+		if (Hash::XXHash3(payload, header.payloadSize) != header.payloadHash)
+		{
+			return fail(U"checksum mismatch");
+		}
+
+		size_t sampleCount = 0;
+		for (size_t bankIndex = 0; bankIndex < banks.size(); ++bankIndex)
+		{
+			BankHeader bankHeader;
+			std::memcpy(&bankHeader, payload + sizeof(BankHeader) * bankIndex, sizeof(bankHeader));
+
+			const auto* waveTables = banks[bankIndex];
+			if (bankHeader.tableCount != waveTables->tableCount() || bankHeader.resolution != waveTables->waveResolution()
+				|| bankHeader.stride != waveTables->tableStride())
 			{
-				m_currentLevel = adsr.sustainLevel;
+				return fail(U"bank layout mismatch");
 			}
-			break;
+			sampleCount += waveTables->tableCount() * waveTables->tableStride();
+		}
 
-		case State::Release: // sustainLevel から 0.0 まで releaseTime かけて減衰する
-			m_currentLevel = m_elapsed < adsr.releaseTime
-				? Math::Lerp(m_prevStateLevel, 0.0, m_elapsed / adsr.releaseTime)
-				: 0.0;
-			break;
+		const size_t samplesOffset = SamplesOffset(banks.size());
+		if (header.payloadSize != samplesOffset + sizeof(float) * sampleCount)
+		{
+			return fail(U"size mismatch");
+		}
 
-		default: break;
+		// マップした先頭はページ境界なので、サンプルの先頭もテーブルの境界に揃っている
+		const auto* samples = reinterpret_cast<const float*>(payload + samplesOffset);
+		for (const auto* waveTables : banks)
+		{
+			for (size_t i = 0; i < waveTables->tableCount(); ++i)
+			{
+				waveTables->attach(i, std::span<const float>(samples, waveTables->waveResolution()));
+				samples += waveTables->tableStride();
+			}
 		}
 
-		m_elapsed += dt;
+		return true;
 	}
 
-	bool isReleased(const ADSRConfig& adsr) const
+	bool isLoaded() const
 	{
-		return m_state == State::Release && adsr.releaseTime <= m_elapsed;
+		return m_file != nullptr;
 	}
 
-	double currentLevel() const
+private:
+
+	struct Header
 	{
-		return m_currentLevel;
-	}
+		char magic[4];
+		uint32 version;
+		uint32 samplingFreq;
+		uint32 bankCount;
+		uint64 payloadSize;
+		uint64 payloadHash;
+	};
 
-	State state() const
+	struct BankHeader
 	{
-		return m_state;
-	}
+		uint32 tableCount;
+		uint32 resolution;
+		uint32 stride;
+		uint32 reserved;
+	};
 
-private:
+	// ペイロードの先頭からサンプルの先頭まで（ファイルの先頭から数えてテーブルの境界に揃える）
+	static size_t SamplesOffset(size_t bankCount)
+	{
+		const size_t alignment = BandLimitedWaveTables::TableAlignment;
+		const size_t headerEnd = sizeof(Header) + sizeof(BankHeader) * bankCount;
+		return (headerEnd + alignment - 1) / alignment * alignment - sizeof(Header);
+	}
 
-	State m_state = State::Attack;
-	double m_elapsed = 0; // ステート変更からの経過秒数
-	double m_currentLevel = 0; // 現在のレベル [0, 1]
-	double m_prevStateLevel = 0; // ステート変更前のレベル [0, 1]
+	std::unique_ptr<MemoryMappedFileView> m_file;
 };
 
-class LFO
+// OscWaveTablesがファイルの中身を参照している間はマップしたままにしておく
+static WaveTableBankFile OscWaveTableBankFile;
+
+// 起動直後の発音で構築待ちが起きないように、裏でテーブルを先に作っておく
+class WaveTablePrewarmer
 {
 public:
 
-	// 位相をリセットする
-	void reset()
+	WaveTablePrewarmer() = default;
+
+	WaveTablePrewarmer(const WaveTablePrewarmer&) = delete;
+	WaveTablePrewarmer& operator=(const WaveTablePrewarmer&) = delete;
+
+	~WaveTablePrewarmer()
 	{
-		m_phase = 0;
+		stop();
 	}
 
-	void update(double dt)
+	void start()
 	{
-		if (m_lfoFunction)
-		{
-			// 音符の長さで周期を設定する場合は、ここでBPMを受け取って時間に変換する
-			const double cycleTime = m_seconds;
-			const double deltaPhase = Math::TwoPi * dt / cycleTime;
+		stop();
 
-			m_currentLevel = m_lfoFunction(m_phase);
-			m_phase += deltaPhase;
+		m_cancel = false;
+		m_finished = false;
+		m_thread = std::thread([this] { run(); });
+	}
 
-			if (Math::TwoPi < m_phase)
+	// 構築途中のテーブルは完成させてから止まる
+	void stop()
+	{
+		m_cancel = true;
+		if (m_thread.joinable())
+		{
+			m_thread.join();
+		}
+	}
+
+	// 全テーブルの構築が終わるまで待つ
+	void wait()
+	{
+		if (m_thread.joinable())
+		{
+			m_thread.join();
+		}
+	}
+
+	bool isFinished() const
+	{
+		return m_finished;
+	}
+
+private:
+
+	void run()
+	{
+		// 低い帯域ほど使われやすいので、波形をまたいで低い帯域から順に作る
+		const auto banks = AllWaveTableBanks();
+
+		size_t maxTableCount = 0;
+		for (const auto* waveTables : banks)
+		{
+			maxTableCount = Max(maxTableCount, waveTables->tableCount());
+		}
+
+		for (size_t i = 0; i < maxTableCount; ++i)
+		{
+			for (const auto* waveTables : banks)
 			{
-				if (m_loop)
+				if (m_cancel)
 				{
-					m_phase -= Math::TwoPi;
+					return;
 				}
-				else
+
+				if (i < waveTables->tableCount())
+				{
+					waveTables->table(i);
+				}
+			}
+		}
+
+		m_finished = true;
+	}
+
+	std::thread m_thread;
+	std::atomic<bool> m_cancel = false;
+	std::atomic<bool> m_finished = false;
+};
+
+const auto SliderHeight = 36;
+const auto SliderWidth = 400;
+const auto LabelWidth = 200;
+
+// エンベロープの各区間での変化の仕方
+enum class EnvelopeCurve
+{
+	Linear,			// 一定の速さで変化する
+	Exponential,	// 始めは速く、目標のレベルに近づくほどゆっくり変化する
+};
+
+struct ADSRConfig
+{
+	double attackTime = 0.01;
+	double decayTime = 0.01;
+	double sustainLevel = 0.6;
+	double sustainResetTime = 0.05;
+	double releaseTime = 0.4;
+	EnvelopeCurve curve = EnvelopeCurve::Linear;
+	double curvature = 5.0; // Exponential のときの曲がり具合（大きいほど始めの変化が急になる）
+
+	void updateGUI(Vec2& pos)
+	{
+		SimpleGUI::Slider(U"attack : {:.2f}"_fmt(attackTime), attackTime, 0.0, 0.5, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+		SimpleGUI::Slider(U"decay : {:.2f}"_fmt(decayTime), decayTime, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+		SimpleGUI::Slider(U"sustain : {:.2f}"_fmt(sustainLevel), sustainLevel, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+		SimpleGUI::Slider(U"release : {:.2f}"_fmt(releaseTime), releaseTime, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+
+		bool exponential = (curve == EnvelopeCurve::Exponential);
+		if (SimpleGUI::CheckBox(exponential, U"exponential", Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth + SliderWidth))
+		{
+			curve = exponential ? EnvelopeCurve::Exponential : EnvelopeCurve::Linear;
+		}
+	}
+};
+
+bool SliderInt(const String& label, int& value, double min, double max, const Vec2& pos, double labelWidth = 80.0, double sliderWidth = 120.0, bool enabled = true)
+{
+	static std::unordered_map<int*, double> val;
+	val[&value] = value;
+	const bool result = SimpleGUI::Slider(label, val[&value], min, max, pos, labelWidth, sliderWidth, enabled);
+	value = static_cast<int>(Math::Round(val[&value]));
+	return result;
+}
+
+// 区間ごとに1サンプルあたりの変化量を先に求めておき、区間の中では level = level * multiplier + addend だけで進める
+// 区間の長さもサンプル数で持つので、次の区間に切り替わるまではまとめて書き出せる
+// ADSR の値は区間の開始時に読む（サステインの維持中だけは sustainLevel の変更にすぐ追従する）
+// 全ボイス分の状態を値の種類ごとの配列で持ち、ボイスのインデックスで読み書きする
+class VoiceEnvelopes
+{
+public:
+
+	enum class State
+	{
+		Attack, Decay, Sustain, Release
+	};
+
+	// ボイス数を設定して、全てのボイスを新しいノートの状態にする
+	void resize(size_t voiceCount)
+	{
+		m_states.assign(voiceCount, State::Attack);
+		m_elapsed.assign(voiceCount, 0.0);
+		m_currentLevels.assign(voiceCount, 0.0);
+		m_segmentStarted.assign(voiceCount, false);
+		m_holding.assign(voiceCount, false);
+		m_finished.assign(voiceCount, false);
+		m_remainingFrames.assign(voiceCount, 0);
+		m_segmentTimes.assign(voiceCount, 0.0);
+		m_nextLevels.assign(voiceCount, 0.0);
+		m_multipliers.assign(voiceCount, 1.0);
+		m_addends.assign(voiceCount, 0.0);
+	}
+
+	size_t size() const
+	{
+		return m_states.size();
+	}
+
+	// 新しいノートとしてレベル 0 のアタックから始める
+	void start(uint32 voice)
+	{
+		reset(voice, State::Attack);
+		m_currentLevels[voice] = 0;
+		m_finished[voice] = false;
+		m_nextLevels[voice] = 0;
+		m_multipliers[voice] = 1.0;
+		m_addends[voice] = 0;
+		m_segmentTimes[voice] = 0;
+	}
+
+	void noteOff(uint32 voice)
+	{
+		if (m_states[voice] != State::Release)
+		{
+			reset(voice, State::Release);
+		}
+	}
+
+	// 現在のレベルから state の区間を始める
+	void reset(uint32 voice, State state)
+	{
+		m_states[voice] = state;
+		m_elapsed[voice] = 0;
+		m_remainingFrames[voice] = 0;
+		m_segmentStarted[voice] = false;
+		m_holding[voice] = false;
+	}
+
+	// voices の各ボイスを frames サンプル分進める
+	// k 番目のボイスのレベルに gains[ボイス] を掛けて levels + k * levelStride に書き出し、進める前のレベルを startLevels[k] に入れる
+	// リリースが終了したらそこで止めて、書き出したサンプル数を activeFrames[k] に入れる
+	void render(std::span<const uint32> voices, const ADSRConfig& adsr, double dt, const float* gains, double* levels, size_t levelStride, double* startLevels, size_t* activeFrames, size_t frames)
+	{
+		for (size_t k = 0; k < voices.size(); ++k)
+		{
+			const auto voice = voices[k];
+			startLevels[k] = m_currentLevels[voice];
+			activeFrames[k] = renderVoice(voice, adsr, dt, gains[voice], levels + k * levelStride, frames);
+		}
+	}
+
+	bool isReleased(uint32 voice) const
+	{
+		return m_finished[voice];
+	}
+
+	double currentLevel(uint32 voice) const
+	{
+		return m_currentLevels[voice];
+	}
+
+	State state(uint32 voice) const
+	{
+		return m_states[voice];
+	}
+
+private:
+
+	size_t renderVoice(uint32 voice, const ADSRConfig& adsr, double dt, double gain, double* levels, size_t frames)
+	{
+		size_t i = 0;
+		while (i < frames && !m_finished[voice])
+		{
+			if (!m_segmentStarted[voice])
+			{
+				startSegment(voice, adsr, dt);
+			}
+
+			if (m_holding[voice])
+			{
+				m_currentLevels[voice] = adsr.sustainLevel;
+				std::fill(levels + i, levels + frames, adsr.sustainLevel * gain);
+				return frames;
+			}
+
+			const size_t count = Min(m_remainingFrames[voice], frames - i);
+
+			if (count == 0)
+			{
+				finishSegment(voice);
+				continue;
+			}
+
+			const double multiplier = m_multipliers[voice];
+			const double addend = m_addends[voice];
+
+			if (multiplier == 1.0)
+			{
+				// 直線の区間は前のサンプルに依存しない形で書けるので、サンプル方向にベクトル化できる
+				const double start = m_nextLevels[voice];
+				for (size_t k = 0; k < count; ++k)
+				{
+					levels[i + k] = (start + addend * k) * gain;
+				}
+				m_currentLevels[voice] = start + addend * (count - 1);
+				m_nextLevels[voice] = start + addend * count;
+			}
+			else
+			{
+				double level = m_nextLevels[voice];
+				double currentLevel = m_currentLevels[voice];
+				for (size_t k = 0; k < count; ++k)
 				{
-					m_phase = Math::TwoPi;
+					currentLevel = level;
+					levels[i + k] = level * gain;
+					level = level * multiplier + addend;
 				}
+				m_currentLevels[voice] = currentLevel;
+				m_nextLevels[voice] = level;
+			}
+
+			m_remainingFrames[voice] -= count;
+			i += count;
+
+			if (m_remainingFrames[voice] == 0)
+			{
+				finishSegment(voice);
+			}
+		}
+
+		return i;
+	}
+
+	// 現在のステートの区間を始める
+	// 開始レベルは直前に出力したレベルで、前の区間からはみ出した m_elapsed 秒だけ進んだところから始める
+	void startSegment(uint32 voice, const ADSRConfig& adsr, double dt)
+	{
+		double target = 0;
+		double time = 0;
+		switch (m_states[voice])
+		{
+		case State::Attack: // 0.0 から 1.0 まで attackTime かけて増幅する
+			target = 1.0;
+			time = adsr.attackTime;
+			break;
+		case State::Decay: // 1.0 から sustainLevel まで decayTime かけて減衰する
+			target = adsr.sustainLevel;
+			time = adsr.decayTime;
+			break;
+		case State::Sustain: // sustainResetTime かけて sustainLevel に戻してから維持する
+			target = adsr.sustainLevel;
+			time = adsr.sustainResetTime;
+			break;
+		case State::Release: // sustainLevel から 0.0 まで releaseTime かけて減衰する
+			target = 0.0;
+			time = adsr.releaseTime;
+			break;
+		default: break;
+		}
+
+		const double elapsed = m_elapsed[voice];
+
+		m_segmentStarted[voice] = true;
+		m_segmentTimes[voice] = time;
+		m_remainingFrames[voice] = (elapsed < time) ? static_cast<size_t>(Math::Ceil((time - elapsed) / dt)) : 0;
+		if (m_remainingFrames[voice] == 0)
+		{
+			// 長さ 0 の区間（decayTime = 0 など）は目標のレベルに飛んで、サンプルを書かずに次の区間に進む
+			m_currentLevels[voice] = target;
+			m_nextLevels[voice] = target;
+			m_multipliers[voice] = 1.0;
+			m_addends[voice] = 0;
+			return;
+		}
+
+		const double start = m_currentLevels[voice];
+		const double x0 = elapsed / time;
+
+		if (adsr.curve == EnvelopeCurve::Exponential && 0.0 < adsr.curvature)
+		{
+			// level(x) = start + (target - start) * (1 - e^{-kx}) / (1 - e^{-k}) は
+			// 漸近線 asymptote との差が1サンプルごとに e^{-k dt / time} 倍になる
+			const double k = adsr.curvature;
+			const double asymptote = start + (target - start) / (1.0 - exp(-k));
+			m_multipliers[voice] = exp(-k * dt / time);
+			m_addends[voice] = asymptote * (1.0 - m_multipliers[voice]);
+			m_nextLevels[voice] = asymptote + (start - asymptote) * exp(-k * x0);
+		}
+		else
+		{
+			m_multipliers[voice] = 1.0;
+			m_addends[voice] = (target - start) * dt / time;
+			m_nextLevels[voice] = Math::Lerp(start, target, x0);
+		}
+
+		// 区間の終わりで次の区間に渡すはみ出し分
+		m_elapsed[voice] += m_remainingFrames[voice] * dt;
+	}
+
+	void finishSegment(uint32 voice)
+	{
+		m_elapsed[voice] -= m_segmentTimes[voice];
+		m_segmentStarted[voice] = false;
+
+		switch (m_states[voice])
+		{
+		case State::Attack:
+			m_states[voice] = State::Decay;
+			break;
+		case State::Decay:
+			m_states[voice] = State::Sustain;
+			break;
+		case State::Sustain:
+			m_holding[voice] = true;
+			m_segmentStarted[voice] = true;
+			break;
+		case State::Release:
+			m_currentLevels[voice] = 0.0;
+			m_finished[voice] = true;
+			break;
+		default: break;
+		}
+	}
+
+	Array<State> m_states;
+	Array<double> m_elapsed; // 区間の開始時点で、その区間に入ってから経過している秒数
+	Array<double> m_currentLevels; // 最後に出力したレベル [0, 1]
+
+	// 現在の区間
+	Array<uint8> m_segmentStarted;
+	Array<uint8> m_holding; // サステインレベルを維持している
+	Array<uint8> m_finished; // リリースが終了した
+	Array<size_t> m_remainingFrames;
+	Array<double> m_segmentTimes;
+	Array<double> m_nextLevels;
+	Array<double> m_multipliers;
+	Array<double> m_addends;
+};
+
+// LFO の波形
+enum class LFOShape
+{
+	None,			// 何も出力しない（0 のまま）
+	Sine,
+	Triangle,
+	Saw,			// -1 から 1 まで上がる
+	Square,
+	SampleAndHold,	// 1周期ごとにランダムな値に切り替わる
+	Table,			// setFunction で渡された関数をテーブルにしたもの
+};
+
+// 制御レート（シンセの m_controlInterval サンプルの区間ごと）で更新する LFO
+// update で区間の両端の値を求め、区間内のブロックの値は setBlockRange で直線補間して求める
+class LFO
+{
+public:
+
+	// setFunction で関数をテーブルにするときの分割数
+	static constexpr size_t FunctionTableSize = 256;
+
+	// 位相をリセットする
+	void reset()
+	{
+		m_phase = 0;
+	}
+
+	// dt 秒分進めて、進める前と後の値を区間の両端の値にする
+	void update(double dt)
+	{
+		if (m_shape == LFOShape::None)
+		{
+			return;
+		}
+
+		// 音符の長さで周期を設定する場合は、ここでBPMを受け取って時間に変換する
+		const double cycleTime = m_seconds;
+		const double deltaPhase = Math::TwoPi * dt / cycleTime;
+
+		m_intervalBeginLevel = evaluate(m_phase);
+		m_phase += deltaPhase;
+
+		if (Math::TwoPi < m_phase)
+		{
+			if (m_loop)
+			{
+				m_phase -= Math::TwoPi;
+
+				if (m_shape == LFOShape::SampleAndHold)
+				{
+					m_holdLevel = Random(-1.0, 1.0, m_rng);
+				}
+			}
+			else
+			{
+				m_phase = Math::TwoPi;
 			}
 		}
+
+		m_intervalEndLevel = evaluate(m_phase);
+		setBlockRange(0.0, 1.0);
+	}
+
+	// 区間の長さを 1 としたときの [begin, end] を処理するブロックの、始まりと終わりの値を区間の両端の値から直線補間で求める
+	void setBlockRange(double begin, double end)
+	{
+		m_currentLevel = Math::Lerp(m_intervalBeginLevel, m_intervalEndLevel, begin);
+		m_endLevel = Math::Lerp(m_intervalBeginLevel, m_intervalEndLevel, end);
 	}
 
 	// 現在の入力値: [0, 2pi]
 	double phase() const
 	{
-		return m_phase;
+		return m_phase;
+	}
+
+	// 現在の出力値（ブロックの始まりの値）: [-1.0, 1.0]
+	double currentLevel() const
+	{
+		return m_currentLevel;
+	}
+
+	// ブロックの終わりの値: [-1.0, 1.0]
+	double endLevel() const
+	{
+		return m_endLevel;
+	}
+
+	// 周期を設定する
+	void setSeconds(double seconds)
+	{
+		m_seconds = seconds;
+	}
+
+	LFOShape shape() const
+	{
+		return m_shape;
+	}
+
+	// 組み込みの波形を設定する
+	void setShape(LFOShape shape)
+	{
+		m_shape = shape;
+	}
+
+	// 任意のカーブを設定する
+	// func は [0, 2pi] の位相を受け取る関数で、ここで一度だけテーブルにしておき毎回は呼ばない
+	void setFunction(std::function<double(double)> func)
+	{
+		if (!func)
+		{
+			m_shape = LFOShape::None;
+			return;
+		}
+
+		m_table.resize(FunctionTableSize + 1);
+		for (size_t i = 0; i <= FunctionTableSize; ++i)
+		{
+			m_table[i] = static_cast<float>(func(Math::TwoPi * i / FunctionTableSize));
+		}
+		m_shape = LFOShape::Table;
+	}
+
+	bool isLoop() const
+	{
+		return m_loop;
+	}
+
+	// ループを有効にする
+	void setLoop(bool isLoop)
+	{
+		m_loop = isLoop;
+	}
+
+private:
+
+	double evaluate(double phase) const
+	{
+		const double t = phase / Math::TwoPi;
+
+		switch (m_shape)
+		{
+		case LFOShape::Sine:
+			return sin(phase);
+		case LFOShape::Triangle:
+			return (t < 0.25) ? 4.0 * t : (t < 0.75) ? 2.0 - 4.0 * t : 4.0 * t - 4.0;
+		case LFOShape::Saw:
+			return 2.0 * t - 1.0;
+		case LFOShape::Square:
+			return (t < 0.5) ? 1.0 : -1.0;
+		case LFOShape::SampleAndHold:
+			return m_holdLevel;
+		case LFOShape::Table:
+		{
+			// 末尾に位相 2pi の値まで持っているので折り返さずに補間できる
+			const double indexFloat = t * FunctionTableSize;
+			const size_t index = Min(static_cast<size_t>(indexFloat), FunctionTableSize - 1);
+			return Math::Lerp(m_table[index], m_table[index + 1], indexFloat - index);
+		}
+		default:
+			return 0.0;
+		}
+	}
+
+	double m_seconds = 1;
+	bool m_loop = true;
+	LFOShape m_shape = LFOShape::None;
+	Array<float> m_table;
+
+	// SampleAndHold の乱数（シードを固定して、オフラインのレンダリングでも毎回同じになるようにする）
+	DefaultRNG m_rng{ 0 };
+	double m_holdLevel = 0;
+
+	double m_phase = 0;
+	double m_intervalBeginLevel = 0;
+	double m_intervalEndLevel = 0;
+	double m_currentLevel = 0;
+	double m_endLevel = 0;
+};
+
+class ModParameter
+{
+public:
+
+	ModParameter(double value) : value(value) {}
+
+	// ブロックの始まりの値を value に、終わりの値を endValue() に設定する
+	// value が書き換わったら true を返す
+	bool fetch(const Array<LFO>& lfoTable)
+	{
+		if (m_modIndex)
+		{
+			const auto& lfo = lfoTable[m_modIndex.value()];
+			const double newValue = Math::Lerp(m_low, m_high, lfo.currentLevel() * 0.5 + 0.5);
+			m_endValue = Math::Lerp(m_low, m_high, lfo.endLevel() * 0.5 + 0.5);
+			if (value != newValue)
+			{
+				value = newValue;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// ブロックの終わりの値（モジュレーションが無ければ value のまま）
+	double endValue() const
+	{
+		return m_modIndex ? m_endValue : value;
+	}
+
+	void setRange(double lowValue, double highValue)
+	{
+		m_low = lowValue;
+		m_high = highValue;
+	}
+
+	void setModIndex(int index)
+	{
+		m_modIndex = index;
+	}
+
+	void unsetModIndex()
+	{
+		m_modIndex = none;
+	}
+
+	double value = 0;
+
+private:
+
+	double m_low = 0;
+	double m_high = 1;
+	double m_endValue = 0;
+	Optional<int> m_modIndex;
+};
+
+// モジュレーションの入力
+enum class ModSource
+{
+	LFO,		// sourceIndex 番目の LFO の値 [-1, 1]
+	Envelope,	// ボイスのエンベロープ [0, 1]
+	Velocity,	// ボイスのベロシティ [0, 1]
+};
+
+// モジュレーションの出力先
+enum class ModDestination
+{
+	PitchShift,	// 半音単位で加算する
+	Amplitude,
+	Pan,
+	Count,
+};
+
+// source の値に depth を掛けて destination に加算する
+struct ModRoute
+{
+	ModSource source;
+	ModDestination destination;
+	double depth;
+	int sourceIndex = 0;
+};
+
+// モジュレーションのルートを出力先ごとにまとめておき、制御ブロックごとにルートのある出力先だけを計算する
+// LFO は全ボイス共通、エンベロープとベロシティはボイスごとの入力として分けて持つ
+class ModMatrix
+{
+public:
+
+	// ブロックの始まりと終わりの加算量（その間は直線的に変化させる）
+	struct Offset
+	{
+		double start = 0;
+		double end = 0;
+	};
+
+	void addRoute(const ModRoute& route)
+	{
+		m_routes.push_back(route);
+		rebuild();
+	}
+
+	void removeRoute(size_t index)
+	{
+		m_routes.erase(m_routes.begin() + index);
+		rebuild();
+	}
+
+	void clear()
+	{
+		m_routes.clear();
+		rebuild();
+	}
+
+	const Array<ModRoute>& routes() const
+	{
+		return m_routes;
+	}
+
+	// LFO のルートがあるか
+	bool hasGlobalRoutes(ModDestination destination) const
+	{
+		return !m_globalRoutes[static_cast<size_t>(destination)].empty();
+	}
+
+	// エンベロープ・ベロシティのルートがあるか
+	bool hasVoiceRoutes(ModDestination destination) const
+	{
+		return !m_voiceRoutes[static_cast<size_t>(destination)].empty();
+	}
+
+	// LFO による加算量（LFO はブロックの先頭で更新しておく）
+	Offset globalOffset(ModDestination destination, const Array<LFO>& lfoTable) const
+	{
+		Offset offset;
+		for (const auto& route : m_globalRoutes[static_cast<size_t>(destination)])
+		{
+			if (lfoTable.size() <= static_cast<size_t>(route.sourceIndex))
+			{
+				continue;
+			}
+
+			const auto& lfo = lfoTable[route.sourceIndex];
+			offset.start += route.depth * lfo.currentLevel();
+			offset.end += route.depth * lfo.endLevel();
+		}
+		return offset;
+	}
+
+	// ボイスごとの入力による加算量
+	double voiceOffset(ModDestination destination, double envelopeLevel, double velocity) const
+	{
+		double offset = 0;
+		for (const auto& route : m_voiceRoutes[static_cast<size_t>(destination)])
+		{
+			offset += route.depth * (route.source == ModSource::Envelope ? envelopeLevel : velocity);
+		}
+		return offset;
+	}
+
+private:
+
+	void rebuild()
+	{
+		for (size_t i = 0; i < DestinationCount; ++i)
+		{
+			m_globalRoutes[i].clear();
+			m_voiceRoutes[i].clear();
+		}
+
+		for (const auto& route : m_routes)
+		{
+			auto& routes = (route.source == ModSource::LFO) ? m_globalRoutes : m_voiceRoutes;
+			routes[static_cast<size_t>(route.destination)].push_back(route);
+		}
+	}
+
+	static constexpr size_t DestinationCount = static_cast<size_t>(ModDestination::Count);
+
+	Array<ModRoute> m_routes;
+	std::array<Array<ModRoute>, DestinationCount> m_globalRoutes;
+	std::array<Array<ModRoute>, DestinationCount> m_voiceRoutes;
+};
+
+// 2^x の近似（|x| < 1022 の範囲で使う）
+// x を最も近い整数 n と r ∈ [-0.5, 0.5] に分け、2^r を e^(r ln2) の 7 次のテイラー展開で求めて指数部に n を足す
+// 相対誤差は (0.5 ln2)^8 / 8! * sqrt(2) / sqrt(0.5) ≈ 1.0e-8 以下（1 セントの周波数比 5.8e-4 に比べて十分小さい）
+// 分岐もテーブル参照も無いので、配列に対するループは自動ベクトル化される
+inline double FastExp2(double x)
+{
+	// 1.5 * 2^52 を足すと、仮数部の下位ビットに x を丸めた整数が入る
+	constexpr double RoundingBias = 6755399441055744.0;
+	const double biased = x + RoundingBias;
+	const double r = x - (biased - RoundingBias);
+	const uint64 scale = (std::bit_cast<uint64>(biased) + 1023) << 52;
+
+	// ln2^k / k!
+	constexpr double c1 = 0.6931471805599453;
+	constexpr double c2 = 0.2402265069591007;
+	constexpr double c3 = 0.05550410866482158;
+	constexpr double c4 = 0.009618129107628477;
+	constexpr double c5 = 0.0013333558146428443;
+	constexpr double c6 = 1.5403530393381608e-4;
+	constexpr double c7 = 1.525273380405984e-5;
+	const double p = 1.0 + r * (c1 + r * (c2 + r * (c3 + r * (c4 + r * (c5 + r * (c6 + r * c7))))));
+
+	return p * std::bit_cast<double>(scale);
+}
+
+// 音律
+// ノート番号ごとのピッチ（半音単位で、12 平均律ならノート番号そのもの）を持ち、ピッチから周波数を求める
+// 微分音や平均律以外の音階はノートのピッチをずらして表す
+class Tuning
+{
+public:
+
+	static constexpr int NoteCount = 128;
+
+	Tuning()
+	{
+		setEqualTemperament();
+	}
+
+	// 12 平均律にする
+	void setEqualTemperament()
+	{
+		for (int i = 0; i < NoteCount; ++i)
+		{
+			m_notePitches[i] = i;
+		}
+	}
+
+	// 1 オクターブの各音（C から B）を平均律から centsOffsets セントずらした音階にする
+	void setScale(const std::array<double, 12>& centsOffsets)
+	{
+		for (int i = 0; i < NoteCount; ++i)
+		{
+			m_notePitches[i] = i + centsOffsets[i % 12] / 100.0;
+		}
+	}
+
+	// ノートごとにピッチを指定する
+	void setNotePitch(int noteNumber, double pitch)
+	{
+		m_notePitches[noteNumber] = pitch;
+	}
+
+	double notePitch(int noteNumber) const
+	{
+		return m_notePitches[noteNumber];
+	}
+
+	// A4（ピッチ 69）の周波数
+	double referenceFrequency() const
+	{
+		return m_referenceFrequency;
+	}
+	void setReferenceFrequency(double frequency)
+	{
+		m_referenceFrequency = frequency;
+	}
+
+	double frequency(double pitch) const
+	{
+		return m_referenceFrequency * FastExp2((pitch - 69) * (1.0 / 12.0));
+	}
+
+	// count 個のピッチをまとめて周波数にする
+	void frequencies(const double* pitches, double* frequencies, size_t count) const
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			frequencies[i] = frequency(pitches[i]);
+		}
+	}
+
+private:
+
+	std::array<double, NoteCount> m_notePitches;
+	double m_referenceFrequency = 440.0;
+};
+
+static constexpr uint32 MaxUnisonSize = 16;
+static constexpr size_t MaxBlockSize = 256; // renderBlock で一度に処理する最大サンプル数
+static constexpr size_t DefaultMaxPolyphony = 64; // 同時発音数の初期値
+static constexpr size_t RenderBlockSize = 64; // MIDI 再生時に一度にレンダリングするサンプル数
+static constexpr double DefaultTargetLatency = 0.1; // 再生バッファの長さ（秒）の初期値
+static constexpr double MinTargetLatency = 0.005; // 再生バッファの長さ（秒）の下限
+static constexpr double MaxTargetLatency = 0.2; // 再生バッファの長さ（秒）の上限
+static const double Semitone = pow(2.0, 1.0 / 12.0) - 1.0;
+
+// ユニゾン波形の初期位相を決める
+// phaseSeed を指定すれば同じシードなら何度生成しても同じ波形になり、指定しなければランダムになる
+void InitUnisonPhases(std::span<double> phases, Optional<uint64> phaseSeed)
+{
+	if (!phaseSeed)
+	{
+		for (auto& initialPhase : phases)
+		{
+			initialPhase = Random(0.0, 2_pi);
+		}
+		return;
+	}
+
+	DefaultRNG rng{ phaseSeed.value() };
+	for (auto& initialPhase : phases)
+	{
+		initialPhase = Random(0.0, 2_pi, rng);
+	}
+}
+
+// 同時発音数を超えたときにどのボイスを再利用するか
+enum class VoiceStealing
+{
+	Oldest,		// 最も古くノートオンされたボイス
+	Quietest,	// 現在の音量が最も小さいボイス
+	SameNote,	// 同じノート番号のボイス（無ければ Oldest）
+};
+
+// オシレーターのウェーブテーブルの引き方
+enum class WaveTableLookup
+{
+	BandCrossfade,		// 細かく分けた帯域の前後2つのテーブルをサンプルごとに補間する
+	Mipmap,				// オクターブごとのテーブルからブロックごとに1つだけ選ぶ（最も軽い）
+	MipmapCrossfade,	// Mipmap に加えて、1つ上のオクターブのテーブルと混ぜて帯域の境目をなめらかにする
+};
+
+// ユニゾン波形を生成する SIMD のカーネルとスカラーのカーネルの差
+struct UnisonKernelError
+{
+	double maxOutputError = 0; // 出力の最大絶対誤差
+	double maxPhaseError = 0; // 生成後の位相の最大絶対誤差
+};
+
+class Synthesizer
+{
+public:
+
+	Synthesizer()
+	{
+		m_detunePitch.fill(1);
+		m_unisonPan.fill(Float2::One().normalize());
+		setMaxPolyphony(DefaultMaxPolyphony);
+	}
+
+	// 1サンプル波形を生成して返す
+	WaveSample renderSample()
+	{
+		WaveSample sample(0, 0);
+		renderBlock(&sample, 1);
+		return sample;
+	}
+
+	// frames サンプル分の波形をまとめて生成して out に書き込む
+	void renderBlock(WaveSample* out, size_t frames)
+	{
+		// 制御レートの格子（m_controlInterval サンプルごと）の境目で分割して処理する
+		// 格子は呼び出しに依らず生成したサンプル数で決まるので、呼び出し側がどこでブロックを区切っても LFO の値は変わらない
+		while (0 < frames)
+		{
+			const size_t blockFrames = Min(frames, m_controlInterval - m_controlPosition);
+			renderBlockImpl(out, blockFrames);
+			out += blockFrames;
+			frames -= blockFrames;
+			m_controlPosition = (m_controlPosition + blockFrames) % m_controlInterval;
+		}
+	}
+
+#if defined(__AVX2__)
+	// 現在の音色で frequency のユニゾン波形を AVX2 のカーネルとスカラーのカーネルでそれぞれ frames サンプル生成して差を返す
+	UnisonKernelError compareUnisonKernels(double frequency, size_t frames, uint64 phaseSeed) const
+	{
+		const auto& waveTables = currentWaveTables();
+		const auto deltaT = 1.0 / SamplingFreq;
+
+		std::array<double, MaxUnisonSize> unisonFrequencies;
+		std::array<double, MaxUnisonSize> unisonDeltaPhases;
+		std::array<double, MaxUnisonSize> unisonDeltaPhaseSteps;
+		for (int d = 0; d < m_unisonCount; ++d)
+		{
+			unisonFrequencies[d] = frequency * m_detunePitch[d];
+			unisonDeltaPhases[d] = deltaT * unisonFrequencies[d] * Math::TwoPiF;
+		}
+
+		std::array<double, MaxUnisonSize> simdPhases;
+		InitUnisonPhases(std::span(simdPhases.data(), m_unisonCount), phaseSeed);
+		auto scalarPhases = simdPhases;
+
+		std::array<double, MaxBlockSize> envLevels;
+		std::array<WaveSample, MaxBlockSize> simdOut;
+		std::array<WaveSample, MaxBlockSize> scalarOut;
+
+		UnisonKernelError error;
+		for (size_t pos = 0; pos < frames; pos += MaxBlockSize)
+		{
+			const size_t blockFrames = Min(MaxBlockSize, frames - pos);
+
+			// 音量も 0 から 1 まで変えておく
+			for (size_t i = 0; i < blockFrames; ++i)
+			{
+				envLevels[i] = 1.0 * (pos + i) / frames;
+			}
+
+			// ピッチのランプも通るように、ブロックごとに位相の増分を +-1% の間で上下させる
+			const double ramp = ((pos / MaxBlockSize) % 2 == 0) ? 0.01 : -0.01;
+			for (int d = 0; d < m_unisonCount; ++d)
+			{
+				unisonDeltaPhaseSteps[d] = unisonDeltaPhases[d] * ramp / blockFrames;
+			}
+
+			simdOut.fill(WaveSample(0, 0));
+			scalarOut.fill(WaveSample(0, 0));
+			renderUnison(simdPhases.data(), waveTables, unisonFrequencies.data(), unisonDeltaPhases.data(), unisonDeltaPhaseSteps.data(), envLevels.data(), simdOut.data(), blockFrames);
+			renderUnisonScalar(scalarPhases.data(), waveTables, unisonFrequencies.data(), unisonDeltaPhases.data(), unisonDeltaPhaseSteps.data(), 0, envLevels.data(), scalarOut.data(), blockFrames);
+
+			for (int d = 0; d < m_unisonCount; ++d)
+			{
+				unisonDeltaPhases[d] += unisonDeltaPhaseSteps[d] * blockFrames;
+			}
+
+			for (size_t i = 0; i < blockFrames; ++i)
+			{
+				error.maxOutputError = Max<double>(error.maxOutputError, std::abs(simdOut[i].left - scalarOut[i].left));
+				error.maxOutputError = Max<double>(error.maxOutputError, std::abs(simdOut[i].right - scalarOut[i].right));
+			}
+		}
+
+		for (int d = 0; d < m_unisonCount; ++d)
+		{
+			error.maxPhaseError = Max(error.maxPhaseError, std::abs(simdPhases[d] - scalarPhases[d]));
+		}
+
+		return error;
+	}
+#endif
+
+	// LFO などの制御値を更新する間隔（サンプル数）
+	// 更新の間は値を直線的に補間するので、短くするほど変化が細かくなる代わりに負荷が増える
+	// 格子は設定した位置から数え直す
+	size_t controlInterval() const
+	{
+		return m_controlInterval;
+	}
+	void setControlInterval(size_t frames)
+	{
+		m_controlInterval = Clamp<size_t>(frames, 1, MaxBlockSize);
+		m_controlPosition = 0;
+		m_controlUpdated = false;
+	}
+
+	// 先頭から samplePosition サンプル生成したときと同じ制御レートの格子の位置に合わせる（途中からレンダリングするときに使う）
+	void alignControlGrid(int64 samplePosition)
+	{
+		m_controlPosition = static_cast<size_t>(samplePosition % static_cast<int64>(m_controlInterval));
+		m_controlUpdated = false;
+	}
+
+	// phaseSeed を指定しなければ初期位相はランダムになる
+	void noteOn(int8_t noteNumber, int8_t velocity, Optional<uint64> phaseSeed = none)
+	{
+		if (!m_mono || m_activeVoices.empty())
+		{
+			const auto voiceIndex = allocateVoice(noteNumber);
+			InitUnisonPhases(voicePhases(voiceIndex), phaseSeed);
+			m_voiceEnvelopes.start(voiceIndex);
+			m_voiceNoteNumbers[voiceIndex] = noteNumber;
+			m_voiceVelocities[voiceIndex] = velocity / 127.0f;
+			m_voiceNoteOnOrders[voiceIndex] = m_noteOnCount++;
+		}
+		else
+		{
+			// モノフォニックでは先頭のボイス以外を解放する
+			while (1 < m_activeVoices.size())
+			{
+				m_freeVoices.push_back(m_activeVoices.back());
+				m_activeVoices.pop_back();
+			}
+
+			// ノート番号が同じとは限らないので、ボイスの状態を引き継いでノート番号を差し替える
+			const auto voiceIndex = m_activeVoices.front();
+			m_voiceNoteNumbers[voiceIndex] = noteNumber;
+			m_voiceVelocities[voiceIndex] = velocity / 127.0f;
+			m_voiceNoteOnOrders[voiceIndex] = m_noteOnCount++;
+			m_voiceEnvelopes.reset(voiceIndex, m_legato ? VoiceEnvelopes::State::Sustain : VoiceEnvelopes::State::Attack);
+		}
+
+		if (m_mono && m_glide)
+		{
+			m_startGlidePitch = m_currentPitch;
+			m_glideElapsed = 0;
+		}
+
+		if (!m_mono)
+		{
+			// LFO の再生状態をリセットする（区間の残りは次のブロックでリセット後の位相から求め直す）
+			for (auto& lfoState : m_lfoStates)
+			{
+				lfoState.reset();
+			}
+			m_controlUpdated = false;
+		}
+	}
+
+	void noteOff(int8_t noteNumber)
+	{
+		// ボイスはノートオンの順に並んでいるので、noteOnになっている最初の要素をnoteOffにする
+		for (const auto voiceIndex : m_activeVoices)
+		{
+			if (m_voiceNoteNumbers[voiceIndex] == noteNumber && m_voiceEnvelopes.state(voiceIndex) != VoiceEnvelopes::State::Release)
+			{
+				m_voiceEnvelopes.noteOff(voiceIndex);
+				break;
+			}
+		}
+	}
+
+	void updateGUI(Vec2& pos)
+	{
+		SimpleGUI::Slider(U"amplitude : {:.2f}"_fmt(m_amplitude.value), m_amplitude.value, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+		SimpleGUI::Slider(U"pan : {:.2f}"_fmt(m_pan.value), m_pan.value, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+		SliderInt(U"oscillator : {}"_fmt(m_oscIndex), m_oscIndex, 0, 3, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
+
+		if (SimpleGUI::Slider(U"pitchShift : {:.2f}"_fmt(m_pitchShift.value), m_pitchShift.value, -24.0, 24.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth)
+			 && KeyControl.pressed())
+		{
+			m_pitchShift.value = Math::Round(m_pitchShift.value);
+		}
+
+		bool unisonUpdated = false;
+		unisonUpdated = SliderInt(U"unisonCount : {}"_fmt(m_unisonCount), m_unisonCount, 1, 16, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth) || unisonUpdated;
+		unisonUpdated = SimpleGUI::Slider(U"detune : {:.2f}"_fmt(m_detune), m_detune, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth) || unisonUpdated;
+		unisonUpdated = SimpleGUI::Slider(U"spread : {:.2f}"_fmt(m_spread), m_spread, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth) || unisonUpdated;
+
+		if (unisonUpdated)
+		{
+			updateUnisonParam();
+		}
+
+		m_adsr.updateGUI(pos);
+
+		const int marginWidth = 32;
+
+		{
+			pos.y += SliderHeight;
+			RectF(pos, LabelWidth + SliderWidth, SliderHeight * (m_mono ? 3 : 1)).draw();
+			SimpleGUI::CheckBox(m_mono, U"mono", pos);
+			if (m_mono)
+			{
+				const auto legatoWidth = SimpleGUI::CheckBoxRegion(U"legato", {}).w;
+				pos.x += marginWidth;
+				SimpleGUI::CheckBox(m_legato, U"legato", Vec2(pos.x, pos.y += SliderHeight));
+				SimpleGUI::CheckBox(m_glide, U"glide", Vec2(pos.x + legatoWidth, pos.y));
+				SimpleGUI::Slider(U"glideTime : {:.2f}"_fmt(m_glideTime), m_glideTime, 0.001, 0.5, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth - marginWidth, SliderWidth);
+				pos.x -= marginWidth;
+			}
+		}
+	}
+
+	// 発音状態を除いた音色のパラメータを other からコピーする
+	void copySettings(const Synthesizer& other)
+	{
+		m_adsr = other.m_adsr;
+		m_lfoStates = other.m_lfoStates;
+		m_amplitude = other.m_amplitude;
+		m_pan = other.m_pan;
+		m_pitchShift = other.m_pitchShift;
+		m_modMatrix = other.m_modMatrix;
+		m_tuning = other.m_tuning;
+		m_oscIndex = other.m_oscIndex;
+		m_waveTableLookup = other.m_waveTableLookup;
+		m_controlInterval = other.m_controlInterval;
+		m_unisonCount = other.m_unisonCount;
+		m_detune = other.m_detune;
+		m_spread = other.m_spread;
+		m_mono = other.m_mono;
+		m_legato = other.m_legato;
+		m_glide = other.m_glide;
+		m_glideTime = other.m_glideTime;
+		m_detunePitch = other.m_detunePitch;
+		m_unisonPan = other.m_unisonPan;
+		m_voiceStealing = other.m_voiceStealing;
+		setMaxPolyphony(other.maxPolyphony());
+	}
+
+	void clear()
+	{
+		m_activeVoices.clear();
+		m_freeVoices.clear();
+
+		// 小さいインデックスから使われるように逆順に積んでおく
+		for (size_t i = m_voiceEnvelopes.size(); 0 < i; --i)
+		{
+			m_freeVoices.push_back(static_cast<uint32>(i - 1));
+		}
+	}
+
+	// 同時発音数を設定する（ボイスを確保し直すので再生中には呼ばない）
+	void setMaxPolyphony(size_t maxPolyphony)
+	{
+		const auto voiceCount = Max<size_t>(maxPolyphony, 1);
+		m_voicePhases.assign(voiceCount * MaxUnisonSize, 0.0);
+		m_voiceEnvelopes.resize(voiceCount);
+		m_voiceVelocities.assign(voiceCount, 1.f);
+		m_voiceNoteNumbers.assign(voiceCount, 0);
+		m_voiceNoteOnOrders.assign(voiceCount, 0);
+
+		m_activeVoices.reserve(voiceCount);
+		m_freeVoices.reserve(voiceCount);
+		m_renderJobs.reserve(voiceCount);
+		m_jobPitches.resize(voiceCount);
+		m_jobEndPitches.resize(voiceCount);
+		m_jobFrequencies.resize(voiceCount);
+		m_jobEndFrequencies.resize(voiceCount);
+		m_voiceEnvLevels.resize(voiceCount);
+		m_voiceEnvelopeStarts.resize(voiceCount);
+		m_voiceActiveFrames.resize(voiceCount);
+		m_unisonFrequencies.resize(voiceCount);
+		m_unisonDeltaPhases.resize(voiceCount);
+		m_unisonDeltaPhaseSteps.resize(voiceCount);
+		m_voiceOutputs.resize(voiceCount);
+		clear();
+	}
+
+	// ボイスの波形生成に使うスレッド数を設定する（1 以下なら呼び出し元のスレッドだけで生成する）
+	// スレッド数によらず出力は同じになる
+	void setRenderThreadCount(size_t threadCount)
+	{
+		if (threadCount == renderThreadCount())
+		{
+			return;
+		}
+
+		m_threadPool = 1 < threadCount ? std::make_unique<WorkStealingThreadPool>(threadCount - 1) : nullptr;
+	}
+
+	size_t renderThreadCount() const
+	{
+		return m_threadPool ? m_threadPool->workerCount() + 1 : 1;
+	}
+
+	size_t maxPolyphony() const
+	{
+		return m_voiceEnvelopes.size();
+	}
+
+	size_t activeVoiceCount() const
+	{
+		return m_activeVoices.size();
+	}
+
+	WaveTableLookup waveTableLookup() const
+	{
+		return m_waveTableLookup;
+	}
+	void setWaveTableLookup(WaveTableLookup waveTableLookup)
+	{
+		m_waveTableLookup = waveTableLookup;
+	}
+
+	VoiceStealing voiceStealing() const
+	{
+		return m_voiceStealing;
+	}
+	void setVoiceStealing(VoiceStealing voiceStealing)
+	{
+		m_voiceStealing = voiceStealing;
+	}
+
+	const ADSRConfig& adsr() const
+	{
+		return m_adsr;
+	}
+	ADSRConfig& adsr()
+	{
+		return m_adsr;
+	}
+
+	const Array<LFO>& lfoStates() const
+	{
+		return m_lfoStates;
+	}
+	Array<LFO>& lfoStates()
+	{
+		return m_lfoStates;
+	}
+
+	int oscIndex() const
+	{
+		return m_oscIndex;
+	}
+	void setOscIndex(int oscIndex)
+	{
+		m_oscIndex = oscIndex;
+	}
+
+	const ModParameter& amplitude() const
+	{
+		return m_amplitude;
+	}
+	ModParameter& amplitude()
+	{
+		return m_amplitude;
+	}
+
+	const ModParameter& pan() const
+	{
+		return m_pan;
+	}
+	ModParameter& pan()
+	{
+		return m_pan;
+	}
+
+	const ModParameter& pitchShift() const
+	{
+		return m_pitchShift;
+	}
+	ModParameter& pitchShift()
+	{
+		return m_pitchShift;
+	}
+
+	const ModMatrix& modMatrix() const
+	{
+		return m_modMatrix;
+	}
+	ModMatrix& modMatrix()
+	{
+		return m_modMatrix;
+	}
+
+	const Tuning& tuning() const
+	{
+		return m_tuning;
+	}
+	Tuning& tuning()
+	{
+		return m_tuning;
+	}
+
+	int unisonCount() const
+	{
+		return m_unisonCount;
+	}
+	void setUnisonCount(int unisonCount)
+	{
+		m_unisonCount = unisonCount;
+		updateUnisonParam();
+	}
+
+	double detune() const
+	{
+		return m_detune;
+	}
+	void setDetune(double detune)
+	{
+		m_detune = detune;
+		updateUnisonParam();
+	}
+
+	double spread() const
+	{
+		return m_spread;
+	}
+	void setSpread(double spread)
+	{
+		m_spread = spread;
+		updateUnisonParam();
+	}
+
+	bool mono() const
+	{
+		return m_mono;
+	}
+	void setMono(bool mono)
+	{
+		m_mono = mono;
+	}
+
+	bool legato() const
+	{
+		return m_legato;
+	}
+	void setLegato(bool legato)
+	{
+		m_legato = legato;
+	}
+
+	bool glide() const
+	{
+		return m_glide;
+	}
+	void setGlide(bool glide)
+	{
+		m_glide = glide;
+	}
+
+	double glideTime() const
+	{
+		return m_glideTime;
+	}
+	void setGlideTime(double glideTime)
+	{
+		m_glideTime = glideTime;
+	}
+
+private:
+
+	// 制御レートの区間を越えない範囲（frames <= m_controlInterval - m_controlPosition）で波形を生成する
+	// LFO は区間の先頭で区間の終わりまで進め、ピッチはブロックの始まりから終わりの値まで位相の増分を直線的に変化させる
+	void renderBlockImpl(WaveSample* out, size_t frames)
+	{
+		if (frames == 0)
+		{
+			return;
+		}
+
+		const auto deltaT = 1.0 / SamplingFreq;
+		const auto blockTime = deltaT * frames;
+
+		std::fill(out, out + frames, WaveSample(0, 0));
+
+		// 区間の先頭で、再生中のノートがあれば LFO を区間の終わりまで進める
+		// 区間の途中で LFO がリセットされたり発音が始まったりしたときは、その位置から区間の終わりまでを求め直す
+		if (m_controlPosition == 0)
+		{
+			m_controlUpdated = false;
+			m_controlSegmentBegin = 0;
+		}
+		if (!m_controlUpdated && !m_activeVoices.empty())
+		{
+			for (auto& lfoState : m_lfoStates)
+			{
+				lfoState.update(deltaT * (m_controlInterval - m_controlPosition));
+			}
+			m_controlSegmentBegin = m_controlPosition;
+			m_controlUpdated = true;
+		}
+
+		// このブロックの始まりと終わりの LFO の値を、区間の両端の値から求める
+		{
+			const double segmentLength = static_cast<double>(m_controlInterval - m_controlSegmentBegin);
+			const double begin = (m_controlPosition - m_controlSegmentBegin) / segmentLength;
+			const double end = (m_controlPosition + frames - m_controlSegmentBegin) / segmentLength;
+			for (auto& lfoState : m_lfoStates)
+			{
+				lfoState.setBlockRange(begin, end);
+			}
+		}
+
+		m_pitchShift.fetch(m_lfoStates);
+		const auto pitchOffset = m_modMatrix.globalOffset(ModDestination::PitchShift, m_lfoStates);
+		const auto pitchShiftStart = m_pitchShift.value + pitchOffset.start;
+		const auto pitchShiftEnd = m_pitchShift.endValue() + pitchOffset.end;
+
+		const auto& waveTables = currentWaveTables();
+
+		// 発音中の全ボイスのエンベロープをまとめて進める（リリースが終了したサンプル以降は無音にする）
+		m_voiceEnvelopes.render(m_activeVoices, m_adsr, deltaT, m_voiceVelocities.data(), m_voiceEnvLevels.front().data(), MaxBlockSize, m_voiceEnvelopeStarts.data(), m_voiceActiveFrames.data(), frames);
+
+		// グライドはボイスの順に依存するので、先にまとめて進めておく
+		m_renderJobs.clear();
+		for (size_t activeIndex = 0; activeIndex < m_activeVoices.size(); ++activeIndex)
+		{
+			const auto voiceIndex = m_activeVoices[activeIndex];
+			const auto activeFrames = m_voiceActiveFrames[activeIndex];
+			if (activeFrames == 0)
+			{
+				continue;
+			}
+
+			const auto velocity = m_voiceVelocities[voiceIndex];
+			const auto envelopeStart = m_voiceEnvelopeStarts[activeIndex];
+
+			const auto targetPitch = m_tuning.notePitch(m_voiceNoteNumbers[voiceIndex]);
+
+			// グライドはピッチ上で直線的に動かす（周波数では指数的に変化する）
+			double startPitch = targetPitch;
+			double endPitch = targetPitch;
+			if (m_mono && m_glide)
+			{
+				startPitch = Math::Lerp(m_startGlidePitch, targetPitch, Saturate(m_glideElapsed / m_glideTime));
+				m_glideElapsed += blockTime;
+				endPitch = Math::Lerp(m_startGlidePitch, targetPitch, Saturate(m_glideElapsed / m_glideTime));
+			}
+			m_currentPitch = endPitch;
+
+			const auto envelopeEnd = m_voiceEnvelopes.currentLevel(voiceIndex);
+
+			auto pitch = startPitch + pitchShiftStart;
+			auto pitchEnd = endPitch + pitchShiftEnd;
+			if (m_modMatrix.hasVoiceRoutes(ModDestination::PitchShift))
+			{
+				pitch += m_modMatrix.voiceOffset(ModDestination::PitchShift, envelopeStart, velocity);
+				pitchEnd += m_modMatrix.voiceOffset(ModDestination::PitchShift, envelopeEnd, velocity);
+			}
+
+			m_jobPitches[m_renderJobs.size()] = pitch;
+			m_jobEndPitches[m_renderJobs.size()] = pitchEnd;
+			m_renderJobs.push_back({ voiceIndex, static_cast<uint32>(activeIndex), activeFrames, envelopeStart, envelopeEnd });
+		}
+
+		// ボイスの周波数、ユニゾン波形ごとの周波数と1サンプルあたりの位相の増分（とその1サンプルあたりの変化量）を、全ボイス分まとめて求めておく
+		m_tuning.frequencies(m_jobPitches.data(), m_jobFrequencies.data(), m_renderJobs.size());
+		m_tuning.frequencies(m_jobEndPitches.data(), m_jobEndFrequencies.data(), m_renderJobs.size());
+		for (size_t jobIndex = 0; jobIndex < m_renderJobs.size(); ++jobIndex)
+		{
+			const auto frequency = m_jobFrequencies[jobIndex];
+			const auto endFrequency = m_jobEndFrequencies[jobIndex];
+			auto& unisonFrequencies = m_unisonFrequencies[jobIndex];
+			auto& unisonDeltaPhases = m_unisonDeltaPhases[jobIndex];
+			auto& unisonDeltaPhaseSteps = m_unisonDeltaPhaseSteps[jobIndex];
+			for (int d = 0; d < m_unisonCount; ++d)
+			{
+				unisonDeltaPhases[d] = deltaT * (frequency * m_detunePitch[d]) * Math::TwoPiF;
+				unisonDeltaPhaseSteps[d] = (deltaT * (endFrequency * m_detunePitch[d]) * Math::TwoPiF - unisonDeltaPhases[d]) / frames;
+
+				// 帯域はブロック内の高い方の周波数で選んで折り返しを防ぐ
+				unisonFrequencies[d] = Max(frequency, endFrequency) * m_detunePitch[d];
+			}
+		}
+
+		// ユニゾン波形の生成はボイスごとに独立しているので、別々のバッファに並列に書き込む
+		const auto renderJob = [&](size_t jobIndex)
+		{
+			const auto& job = m_renderJobs[jobIndex];
+			auto& voiceOut = m_voiceOutputs[jobIndex];
+			std::fill_n(voiceOut.data(), job.frames, WaveSample(0, 0));
+			renderUnison(voicePhases(job.voiceIndex).data(), waveTables, m_unisonFrequencies[jobIndex].data(), m_unisonDeltaPhases[jobIndex].data(), m_unisonDeltaPhaseSteps[jobIndex].data(), m_voiceEnvLevels[job.levelIndex].data(), voiceOut.data(), job.frames);
+		};
+
+		if (m_threadPool)
+		{
+			m_threadPool->parallelFor(m_renderJobs.size(), renderJob);
+		}
+		else
+		{
+			for (size_t jobIndex = 0; jobIndex < m_renderJobs.size(); ++jobIndex)
+			{
+				renderJob(jobIndex);
+			}
+		}
+
+		// パンと音量はブロックの始まりから終わりの値まで直線的に変化させる
+		m_pan.fetch(m_lfoStates);
+		m_amplitude.fetch(m_lfoStates);
+		const auto panOffset = m_modMatrix.globalOffset(ModDestination::Pan, m_lfoStates);
+		const auto amplitudeOffset = m_modMatrix.globalOffset(ModDestination::Amplitude, m_lfoStates);
+		const auto panStart = Saturate(m_pan.value + panOffset.start);
+		const auto panEnd = Saturate(m_pan.endValue() + panOffset.end);
+		const auto amplitudeStart = Max(m_amplitude.value + amplitudeOffset.start, 0.0);
+		const auto amplitudeEnd = Max(m_amplitude.endValue() + amplitudeOffset.end, 0.0);
+		const auto unisonScale = sqrt(m_unisonCount);
+		const float invFrames = 1.0f / frames;
+
+		// ボイスごとの入力がパンか音量に繋がっていれば、ボイスごとにパンと音量を掛けてから足し合わせる
+		if (m_modMatrix.hasVoiceRoutes(ModDestination::Pan) || m_modMatrix.hasVoiceRoutes(ModDestination::Amplitude))
+		{
+			for (size_t jobIndex = 0; jobIndex < m_renderJobs.size(); ++jobIndex)
+			{
+				const auto& job = m_renderJobs[jobIndex];
+				const auto velocity = m_voiceVelocities[job.voiceIndex];
+				const auto voicePan = [&](double envelopeLevel, double pan)
+				{
+					return Saturate(pan + m_modMatrix.voiceOffset(ModDestination::Pan, envelopeLevel, velocity));
+				};
+				const auto voiceGain = [&](double envelopeLevel, double amplitude)
+				{
+					return Max(amplitude + m_modMatrix.voiceOffset(ModDestination::Amplitude, envelopeLevel, velocity), 0.0) / unisonScale;
+				};
+
+				const auto startPan = voicePan(job.envelopeStart, panStart);
+				const auto endPan = voicePan(job.envelopeEnd, panEnd);
+				const auto startGain = voiceGain(job.envelopeStart, amplitudeStart);
+				const auto endGain = voiceGain(job.envelopeEnd, amplitudeEnd);
+
+				const auto left = static_cast<float>(cos(Math::HalfPi * startPan) * startGain);
+				const auto right = static_cast<float>(sin(Math::HalfPi * startPan) * startGain);
+				const auto leftDelta = static_cast<float>(cos(Math::HalfPi * endPan) * endGain) - left;
+				const auto rightDelta = static_cast<float>(sin(Math::HalfPi * endPan) * endGain) - right;
+
+				const auto& voiceOut = m_voiceOutputs[jobIndex];
+				for (size_t i = 0; i < job.frames; ++i)
+				{
+					const float t = i * invFrames;
+					out[i].left += voiceOut[i].left * (left + leftDelta * t);
+					out[i].right += voiceOut[i].right * (right + rightDelta * t);
+				}
+			}
+		}
+		else
+		{
+			// ボイスの順に足し合わせる（スレッド数によらず同じ結果になる）
+			for (size_t jobIndex = 0; jobIndex < m_renderJobs.size(); ++jobIndex)
+			{
+				const auto& voiceOut = m_voiceOutputs[jobIndex];
+				for (size_t i = 0; i < m_renderJobs[jobIndex].frames; ++i)
+				{
+					out[i].left += voiceOut[i].left;
+					out[i].right += voiceOut[i].right;
+				}
+			}
+
+			const auto panLeft = static_cast<float>(cos(Math::HalfPi * panStart));
+			const auto panRight = static_cast<float>(sin(Math::HalfPi * panStart));
+			const auto panLeftDelta = static_cast<float>(cos(Math::HalfPi * panEnd)) - panLeft;
+			const auto panRightDelta = static_cast<float>(sin(Math::HalfPi * panEnd)) - panRight;
+
+			const auto gain = static_cast<float>(amplitudeStart / unisonScale);
+			const auto gainDelta = static_cast<float>(amplitudeEnd / unisonScale) - gain;
+
+			for (size_t i = 0; i < frames; ++i)
+			{
+				const float t = i * invFrames;
+				out[i].left *= panLeft + panLeftDelta * t;
+				out[i].right *= panRight + panRightDelta * t;
+				out[i] = out[i] * (gain + gainDelta * t);
+			}
+		}
+
+		// リリースが終了したボイスを解放する（残りのボイスの順番は保つ）
+		std::erase_if(m_activeVoices, [&](uint32 voiceIndex)
+			{
+				if (m_voiceEnvelopes.isReleased(voiceIndex))
+				{
+					m_freeVoices.push_back(voiceIndex);
+					return true;
+				}
+				return false;
+			});
+	}
+
+	const BandLimitedWaveTables& currentWaveTables() const
+	{
+		return (m_waveTableLookup == WaveTableLookup::BandCrossfade) ? OscWaveTables[m_oscIndex] : OscMipmapTables[m_oscIndex];
+	}
+
+	BandLimitedWaveTables::BandSelection selectBand(const BandLimitedWaveTables& waveTables, double frequency) const
+	{
+		switch (m_waveTableLookup)
+		{
+		case WaveTableLookup::Mipmap: return waveTables.selectMipmap(frequency, false);
+		case WaveTableLookup::MipmapCrossfade: return waveTables.selectMipmap(frequency, true);
+		default: return waveTables.selectBand(frequency);
+		}
+	}
+
+	// ユニゾンの各波形を envLevels の音量で out に加算して、phases を進める
+	// 位相の増分は unisonDeltaPhases から1サンプルごとに unisonDeltaPhaseSteps ずつ変化させる
+	void renderUnison(double* phases, const BandLimitedWaveTables& waveTables, const double* unisonFrequencies, const double* unisonDeltaPhases, const double* unisonDeltaPhaseSteps, const double* envLevels, WaveSample* out, size_t frames) const
+	{
+		int d = 0;
+
+#if defined(__AVX2__)
+		// 4 波形ずつまとめて処理する
+		for (; d + 4 <= m_unisonCount; d += 4)
+		{
+			renderUnison4(phases, waveTables, unisonFrequencies, unisonDeltaPhases, unisonDeltaPhaseSteps, d, envLevels, out, frames);
+		}
+#endif
+
+		renderUnisonScalar(phases, waveTables, unisonFrequencies, unisonDeltaPhases, unisonDeltaPhaseSteps, d, envLevels, out, frames);
+	}
+
+	// ユニゾン波形 [firstIndex, m_unisonCount) を1つずつ処理する
+	void renderUnisonScalar(double* phases, const BandLimitedWaveTables& waveTables, const double* unisonFrequencies, const double* unisonDeltaPhases, const double* unisonDeltaPhaseSteps, int firstIndex, const double* envLevels, WaveSample* out, size_t frames) const
+	{
+		for (int d = firstIndex; d < m_unisonCount; ++d)
+		{
+			const auto deltaPhaseStep = unisonDeltaPhaseSteps[d];
+			const auto band = selectBand(waveTables, unisonFrequencies[d]);
+			const auto unisonPan = m_unisonPan[d];
+
+			auto phase = phases[d];
+			auto deltaPhase = unisonDeltaPhases[d];
+
+			// テーブルが1つだけなら補間相手を読まずに済ませる
+			const auto renderLoop = [&](auto singleTable)
+			{
+				for (size_t i = 0; i < frames; ++i)
+				{
+					double osc;
+					if constexpr (decltype(singleTable)::value)
+					{
+						osc = band.prev->get(phase);
+					}
+					else
+					{
+						osc = waveTables.get(phase, band);
+					}
+
+					phase += deltaPhase;
+					deltaPhase += deltaPhaseStep;
+					if (Math::TwoPi < phase)
+					{
+						phase -= Math::TwoPi;
+					}
+
+					const auto w = static_cast<float>(osc * envLevels[i]);
+					out[i].left += w * unisonPan.x;
+					out[i].right += w * unisonPan.y;
+				}
+			};
+
+			if (band.prev == band.next)
+			{
+				renderLoop(std::true_type{});
+			}
+			else
+			{
+				renderLoop(std::false_type{});
+			}
+
+			phases[d] = phase;
+		}
+	}
+
+#if defined(__AVX2__)
+	// ユニゾン波形 [firstIndex, firstIndex + 4) を AVX2 で同時に処理する
+	// 波形ごとに参照するテーブルが異なるので、先頭レーンのテーブルからのオフセットで gather する
+	void renderUnison4(double* phases, const BandLimitedWaveTables& waveTables, const double* unisonFrequencies, const double* unisonDeltaPhases, const double* unisonDeltaPhaseSteps, int firstIndex, const double* envLevels, WaveSample* out, size_t frames) const
+	{
+		alignas(32) double rates[4];
+		alignas(32) int64 prevOffsets[4];
+		alignas(32) int64 nextOffsets[4];
+		alignas(16) float panX[4];
+		alignas(16) float panY[4];
+
+		std::array<BandLimitedWaveTables::BandSelection, 4> bands;
+		for (int k = 0; k < 4; ++k)
+		{
+			bands[k] = selectBand(waveTables, unisonFrequencies[firstIndex + k]);
+			rates[k] = bands[k].rate;
+			panX[k] = m_unisonPan[firstIndex + k].x;
+			panY[k] = m_unisonPan[firstIndex + k].y;
+		}
+
+		const float* base = bands[0].prev->data();
+		const auto offsetFromBase = [&](const OscillatorWavetable* table)
+		{
+			return static_cast<int64>((reinterpret_cast<std::intptr_t>(table->data()) - reinterpret_cast<std::intptr_t>(base)) / static_cast<std::intptr_t>(sizeof(float)));
+		};
+		for (int k = 0; k < 4; ++k)
+		{
+			prevOffsets[k] = offsetFromBase(bands[k].prev);
+			nextOffsets[k] = offsetFromBase(bands[k].next);
+		}
+
+		// 同じ BandLimitedWaveTables のテーブルは全て同じ解像度
+		const __m256d xToIndex = _mm256_set1_pd(bands[0].prev->xToIndex());
+		const __m128i one = _mm_set1_epi32(1);
+		const __m256d twoPi = _mm256_set1_pd(Math::TwoPi);
+
+		const __m256d deltaPhaseStep = _mm256_loadu_pd(unisonDeltaPhaseSteps + firstIndex);
+		const __m256d rate = _mm256_load_pd(rates);
+		const __m256i prevOffset = _mm256_load_si256(reinterpret_cast<const __m256i*>(prevOffsets));
+		const __m256i nextOffset = _mm256_load_si256(reinterpret_cast<const __m256i*>(nextOffsets));
+		const __m128 panXV = _mm_load_ps(panX);
+		const __m128 panYV = _mm_load_ps(panY);
+
+		__m256d phase = _mm256_loadu_pd(phases + firstIndex);
+		__m256d deltaPhase = _mm256_loadu_pd(unisonDeltaPhases + firstIndex);
+
+		const auto horizontalSum = [](__m128 v)
+		{
+			__m128 shuf = _mm_movehdup_ps(v);
+			__m128 sums = _mm_add_ps(v, shuf);
+			shuf = _mm_movehl_ps(shuf, sums);
+			sums = _mm_add_ss(sums, shuf);
+			return _mm_cvtss_f32(sums);
+		};
+
+		// 4 波形とも補間相手が無ければ、そちらの gather を省く
+		const bool isSingleTable = std::all_of(bands.begin(), bands.end(), [](const auto& band) { return band.prev == band.next; });
+
+		const auto renderLoop = [&](auto singleTable)
+		{
+			for (size_t i = 0; i < frames; ++i)
+			{
+				// OscillatorWavetable::get と同じ手順でインデックスを求める（末尾のガードサンプルがあるので折り返さない）
+				const __m256d indexFloat = _mm256_mul_pd(phase, xToIndex);
+				const __m128i prevIndex = _mm256_cvttpd_epi32(indexFloat);
+				const __m128i nextIndex = _mm_add_epi32(prevIndex, one);
+
+				const __m256d x01 = _mm256_sub_pd(indexFloat, _mm256_cvtepi32_pd(prevIndex));
+
+				const __m256i prevIndex64 = _mm256_cvtepi32_epi64(prevIndex);
+				const __m256i nextIndex64 = _mm256_cvtepi32_epi64(nextIndex);
+
+				const __m128 prev0 = _mm256_i64gather_ps(base, _mm256_add_epi64(prevOffset, prevIndex64), 4);
+				const __m128 prev1 = _mm256_i64gather_ps(base, _mm256_add_epi64(prevOffset, nextIndex64), 4);
+				const __m256d prevLevel = _mm256_add_pd(_mm256_cvtps_pd(prev0), _mm256_mul_pd(_mm256_cvtps_pd(_mm_sub_ps(prev1, prev0)), x01));
+
+				__m256d osc;
+				if constexpr (decltype(singleTable)::value)
+				{
+					osc = prevLevel;
+				}
+				else
+				{
+					const __m128 next0 = _mm256_i64gather_ps(base, _mm256_add_epi64(nextOffset, prevIndex64), 4);
+					const __m128 next1 = _mm256_i64gather_ps(base, _mm256_add_epi64(nextOffset, nextIndex64), 4);
+
+					const __m256d nextLevel = _mm256_add_pd(_mm256_cvtps_pd(next0), _mm256_mul_pd(_mm256_cvtps_pd(_mm_sub_ps(next1, next0)), x01));
+					osc = _mm256_add_pd(prevLevel, _mm256_mul_pd(_mm256_sub_pd(nextLevel, prevLevel), rate));
+				}
+
+				phase = _mm256_add_pd(phase, deltaPhase);
+				deltaPhase = _mm256_add_pd(deltaPhase, deltaPhaseStep);
+				phase = _mm256_sub_pd(phase, _mm256_and_pd(_mm256_cmp_pd(twoPi, phase, _CMP_LT_OQ), twoPi));
+
+				const __m128 w = _mm256_cvtpd_ps(_mm256_mul_pd(osc, _mm256_set1_pd(envLevels[i])));
+				out[i].left += horizontalSum(_mm_mul_ps(w, panXV));
+				out[i].right += horizontalSum(_mm_mul_ps(w, panYV));
+			}
+		};
+
+		if (isSingleTable)
+		{
+			renderLoop(std::true_type{});
+		}
+		else
+		{
+			renderLoop(std::false_type{});
+		}
+
+		_mm256_storeu_pd(phases + firstIndex, phase);
+	}
+#endif
+
+	// 空いているボイスを確保する（空きが無ければ m_voiceStealing に従って再利用する）
+	uint32 allocateVoice(int8_t noteNumber)
+	{
+		if (!m_freeVoices.empty())
+		{
+			const auto voiceIndex = m_freeVoices.back();
+			m_freeVoices.pop_back();
+			m_activeVoices.push_back(voiceIndex);
+			return voiceIndex;
+		}
+
+		auto stealIt = m_activeVoices.end();
+
+		if (m_voiceStealing == VoiceStealing::SameNote)
+		{
+			stealIt = std::find_if(m_activeVoices.begin(), m_activeVoices.end(),
+				[&](uint32 voiceIndex) { return m_voiceNoteNumbers[voiceIndex] == noteNumber; });
+		}
+		else if (m_voiceStealing == VoiceStealing::Quietest)
+		{
+			stealIt = std::min_element(m_activeVoices.begin(), m_activeVoices.end(), [&](uint32 a, uint32 b)
+				{
+					return m_voiceEnvelopes.currentLevel(a) * m_voiceVelocities[a]
+						< m_voiceEnvelopes.currentLevel(b) * m_voiceVelocities[b];
+				});
+		}
+
+		if (stealIt == m_activeVoices.end())
+		{
+			stealIt = std::min_element(m_activeVoices.begin(), m_activeVoices.end(),
+				[&](uint32 a, uint32 b) { return m_voiceNoteOnOrders[a] < m_voiceNoteOnOrders[b]; });
+		}
+
+		// 再利用するボイスは最も新しいボイスとして末尾に移す
+		const auto voiceIndex = *stealIt;
+		m_activeVoices.erase(stealIt);
+		m_activeVoices.push_back(voiceIndex);
+		return voiceIndex;
+	}
+
+	void updateUnisonParam()
+	{
+		// ユニゾンなし
+		if (m_unisonCount == 1)
+		{
+			m_detunePitch.fill(1);
+			m_unisonPan.fill(Float2::One().normalize());
+			return;
+		}
+
+		// ユニゾンあり
+		for (int d = 0; d < m_unisonCount; ++d)
+		{
+			// 各波形の位置を[-1, 1]で計算する
+			const auto detunePos = Math::Lerp(-1.0, 1.0, 1.0 * d / (m_unisonCount - 1));
+
+			// 現在の周波数から最大で Semitone * m_detune だけピッチシフトする
+			m_detunePitch[d] = static_cast<float>(1.0 + Semitone * m_detune * detunePos);
+
+			// Math::QuarterPi が中央
+			const auto unisonAngle = Math::QuarterPi * (1.0 + detunePos * m_spread);
+			m_unisonPan[d] = Float2(cos(unisonAngle), sin(unisonAngle));
+		}
+	}
+
+	// ボイスのユニゾン波形の位相（MaxUnisonSize 個ずつ並ぶ）
+	std::span<double> voicePhases(uint32 voiceIndex)
+	{
+		return std::span<double>(m_voicePhases.data() + static_cast<size_t>(voiceIndex) * MaxUnisonSize, MaxUnisonSize);
+	}
+
+	// 全ボイスをあらかじめ確保しておき、発音中のボイスはインデックスで管理する
+	// ボイスの状態は種類ごとに別の配列に持ち、ブロックごとの処理では同じ種類の値を続けて読むようにする
+	Array<double> m_voicePhases;
+	VoiceEnvelopes m_voiceEnvelopes;
+	Array<float> m_voiceVelocities;
+	Array<int8_t> m_voiceNoteNumbers;
+	Array<uint64> m_voiceNoteOnOrders; // ノートオンされた順番（古いボイスの判定に使う）
+	Array<uint32> m_activeVoices; // ノートオンの順に並ぶ
+	Array<uint32> m_freeVoices;
+	VoiceStealing m_voiceStealing = VoiceStealing::Oldest;
+	uint64 m_noteOnCount = 0;
+
+	// renderBlockImpl で生成するボイスごとの作業領域
+	struct VoiceRenderJob
+	{
+		uint32 voiceIndex;
+		uint32 levelIndex; // m_voiceEnvLevels のインデックス（m_activeVoices での位置）
+		size_t frames;
+		double envelopeStart; // モジュレーションの入力に使うエンベロープの値（ブロックの始まりと終わり）
+		double envelopeEnd;
+	};
+	Array<VoiceRenderJob> m_renderJobs;
+	Array<double> m_jobPitches; // ブロックの始まりのピッチ
+	Array<double> m_jobEndPitches; // ブロックの終わりのピッチ
+	Array<double> m_jobFrequencies;
+	Array<double> m_jobEndFrequencies;
+	Array<std::array<double, MaxBlockSize>> m_voiceEnvLevels;
+	Array<double> m_voiceEnvelopeStarts;
+	Array<size_t> m_voiceActiveFrames;
+	Array<std::array<double, MaxUnisonSize>> m_unisonFrequencies;
+	Array<std::array<double, MaxUnisonSize>> m_unisonDeltaPhases;
+	Array<std::array<double, MaxUnisonSize>> m_unisonDeltaPhaseSteps;
+	Array<std::array<WaveSample, MaxBlockSize>> m_voiceOutputs;
+	std::unique_ptr<WorkStealingThreadPool> m_threadPool;
+
+	ADSRConfig m_adsr;
+
+	Array<LFO> m_lfoStates;
+
+	ModParameter m_amplitude = 0.1;
+	ModParameter m_pan = 0.5;
+	ModParameter m_pitchShift = 0.0;
+	ModMatrix m_modMatrix;
+	Tuning m_tuning;
+	int m_oscIndex = 0;
+	WaveTableLookup m_waveTableLookup = WaveTableLookup::BandCrossfade;
+	size_t m_controlInterval = MaxBlockSize;
+	size_t m_controlPosition = 0; // 制御レートの区間内の位置（サンプル数）
+	size_t m_controlSegmentBegin = 0; // 区間内で LFO を最後に求め直した位置
+	bool m_controlUpdated = false; // 現在の区間の LFO を求めたか
+
+	int m_unisonCount = 1;
+	double m_detune = 0;
+	double m_spread = 1.0;
+
+	bool m_mono = false;
+	bool m_legato = false;
+	bool m_glide = false;
+	double m_glideTime = 0.001;
+
+	std::array<float, MaxUnisonSize> m_detunePitch;
+	std::array<Float2, MaxUnisonSize> m_unisonPan;
+
+	double m_currentPitch = 69; // 現在のピッチ（半音単位、直前のブロックの終わりの値）を常に保存しておく
+	double m_startGlidePitch = 69; // グライド開始時のピッチ
+	double m_glideElapsed = 0.0; // グライド開始から経過した秒数
+};
+
+// スケジューラから取り出した MIDI イベントをシンセに登録する
+void ApplyMidiEvent(Synthesizer& synth, const MidiData& midiData, const ScheduledMidiEvent& event)
+{
+	if (midiData.tracks()[event.trackIndex].isPercussionTrack())
+	{
+		return;
+	}
+
+	if (const auto* noteOff = std::get_if<NoteOffEvent>(&event.data))
+	{
+		synth.noteOff(noteOff->note_number);
+	}
+	else if (const auto* noteOn = std::get_if<NoteOnEvent>(&event.data))
+	{
+		// 初期位相はイベントから決めて、分割してレンダリングしても同じ波形になるようにする
+		const uint64 phaseSeed = (static_cast<uint64>(event.sampleIndex) << 24) ^ (static_cast<uint64>(event.trackIndex) << 8) ^ static_cast<uint8>(noteOn->note_number);
+		synth.noteOn(noteOn->note_number, noteOn->velocity, phaseSeed);
+	}
+}
+
+struct RenderStats
+{
+	double renderSeconds = 0; // レンダリングにかかった時間
+	double audioSeconds = 0; // 生成した波形の長さ
+	int64 samples = 0;
+	size_t peakVoiceCount = 0;
+
+	// 並列レンダリングで指定した分け方が使えず、別の分け方に切り替えたときの理由
+	String fallbackReason;
+
+	// 実時間の何倍の速さでレンダリングできたか
+	double realtimeFactor() const
+	{
+		return audioSeconds / renderSeconds;
+	}
+
+	double samplesPerSecond() const
+	{
+		return samples / renderSeconds;
+	}
+};
+
+// 最後のノートのリリースまで含めた長さ
+int64 RenderLengthOfSamples(const Synthesizer& synth, const MidiData& midiData)
+{
+	return static_cast<int64>(ceil((midiData.lengthOfTime() + synth.adsr().releaseTime) * SamplingFreq));
+}
+
+// ノートイベントのチャンネル（ノート以外のイベントなら none）
+Optional<uint8> NoteEventChannel(const ScheduledMidiEvent& event)
+{
+	if (const auto* noteOn = std::get_if<NoteOnEvent>(&event.data))
+	{
+		return noteOn->channel;
+	}
+	if (const auto* noteOff = std::get_if<NoteOffEvent>(&event.data))
+	{
+		return noteOff->channel;
+	}
+	return none;
+}
+
+// レンダリングに使うイベントの絞り込み（何も指定しなければ全てのイベントを使う）
+struct MidiEventFilter
+{
+	Optional<uint32> trackIndex;
+	Optional<uint8> channel;
+
+	// 読み飛ばすノートオフ（サンプル位置とノート番号）。途中からレンダリングするときに、それより前のノートに対応するものを入れておく
+	Array<std::pair<int64, uint8>> ignoredNoteOffs;
+
+	// event を使うか判定する（読み飛ばしたノートオフは ignoredNoteOffs から取り除く）
+	bool accept(const ScheduledMidiEvent& event)
+	{
+		if (trackIndex && event.trackIndex != trackIndex.value())
+		{
+			return false;
+		}
+		if (channel && NoteEventChannel(event) != channel)
+		{
+			return false;
+		}
+		if (const auto* noteOff = std::get_if<NoteOffEvent>(&event.data))
+		{
+			const auto it = std::find(ignoredNoteOffs.begin(), ignoredNoteOffs.end(), std::make_pair(event.sampleIndex, noteOff->note_number));
+			if (it != ignoredNoteOffs.end())
+			{
+				ignoredNoteOffs.erase(it);
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// [beginPos, endPos) の範囲の波形を out に書き込む（filter に合うイベントだけを使う）
+// scheduler は beginPos までのイベントを処理済みの状態で渡す
+// blockVoiceCounts を渡すと、RenderBlockSize ごとに区切った区間での最大の同時発音数を書き込む（区間の番号は サンプル位置 / RenderBlockSize）
+void RenderRange(Synthesizer& synth, const MidiData& midiData, MidiEventScheduler& scheduler, int64 beginPos, int64 endPos, WaveSample* out, MidiEventFilter filter, size_t& peakVoiceCount, Array<uint16>* blockVoiceCounts = nullptr)
+{
+	for (int64 pos = beginPos; pos < endPos;)
+	{
+		scheduler.dispatch(pos, [&](const ScheduledMidiEvent& event)
+			{
+				if (filter.accept(event))
+				{
+					ApplyMidiEvent(synth, midiData, event);
+				}
+			});
+
+		int64 frames = Min<int64>(RenderBlockSize, endPos - pos);
+		if (const auto nextEvent = scheduler.nextEventSample())
+		{
+			frames = Min(frames, nextEvent.value() - pos);
+		}
+
+		synth.renderBlock(out + (pos - beginPos), static_cast<size_t>(frames));
+		peakVoiceCount = Max(peakVoiceCount, synth.activeVoiceCount());
+
+		if (blockVoiceCounts)
+		{
+			const auto voiceCount = static_cast<uint16>(synth.activeVoiceCount());
+			for (int64 block = pos / RenderBlockSize; block <= (pos + frames - 1) / RenderBlockSize; ++block)
+			{
+				(*blockVoiceCounts)[block] = Max((*blockVoiceCounts)[block], voiceCount);
+			}
+		}
+
+		pos += frames;
+	}
+}
+
+// MIDI データ全体をオフラインでレンダリングする
+Wave RenderWave(Synthesizer& synth, const MidiData& midiData, RenderStats& stats)
+{
+	const auto lengthOfSamples = RenderLengthOfSamples(synth, midiData);
+
+	Wave wave(lengthOfSamples);
+
+	MidiEventScheduler scheduler(midiData, SamplingFreq);
+
+	stats = RenderStats();
+	Stopwatch stopwatch{ StartImmediately::Yes };
+
+	RenderRange(synth, midiData, scheduler, 0, lengthOfSamples, wave.data(), MidiEventFilter(), stats.peakVoiceCount);
+
+	stats.renderSeconds = stopwatch.sF();
+	stats.audioSeconds = 1.0 * lengthOfSamples / SamplingFreq;
+	stats.samples = lengthOfSamples;
+
+	return wave;
+}
+
+// ノートが鳴っている（押されているかリリース中の）区間
+struct SoundingNote
+{
+	uint8 noteNumber;
+	int64 beginSample; // ノートオンのサンプル位置
+	int64 endSample; // リリースが終わるサンプル位置（最後まで離さなければ int64 の最大値）
+	Optional<int64> noteOffSample;
+};
+
+// ノートごとに鳴っている区間を求める（ノートオンの順）
+// ノートオフは Synthesizer::noteOff と同じく、トラックやチャンネルによらず同じノート番号でまだ離していない最も古いノートに対応づける
+Array<SoundingNote> GetSoundingNotes(const MidiData& midiData, const MidiEventScheduler& timeline, int64 releaseLength)
+{
+	Array<SoundingNote> notes;
+	Array<size_t> heldNotes; // まだ離していないノートの notes のインデックス（ノートオンの順）
+
+	for (const auto& event : timeline.events())
+	{
+		if (midiData.tracks()[event.trackIndex].isPercussionTrack())
+		{
+			continue;
+		}
+
+		if (const auto* noteOff = std::get_if<NoteOffEvent>(&event.data))
+		{
+			const auto it = std::find_if(heldNotes.begin(), heldNotes.end(), [&](size_t noteIndex) { return notes[noteIndex].noteNumber == noteOff->note_number; });
+			if (it != heldNotes.end())
+			{
+				notes[*it].endSample = event.sampleIndex + releaseLength;
+				notes[*it].noteOffSample = event.sampleIndex;
+				heldNotes.erase(it);
+			}
+		}
+		else if (const auto* noteOn = std::get_if<NoteOnEvent>(&event.data))
+		{
+			heldNotes.push_back(notes.size());
+			notes.push_back({ noteOn->note_number, event.sampleIndex, std::numeric_limits<int64>::max(), none });
+		}
+	}
+
+	return notes;
+}
+
+// 並列レンダリングでの仕事の分け方
+enum class RenderSplit
+{
+	Track,			// トラックごとに全体をレンダリングして足し合わせる
+	Channel,		// MIDI チャンネルごとに全体をレンダリングして足し合わせる
+	TimeSegment,	// 一定の長さの区間ごとにレンダリングしてつなげる
+	Single,			// 分けずに1つの仕事でレンダリングする（区間に分けられないときに使う）
+};
+
+struct ParallelRenderConfig
+{
+	RenderSplit split = RenderSplit::TimeSegment;
+	size_t threadCount = Max(std::thread::hardware_concurrency(), 1u);
+	double segmentSeconds = 10.0; // TimeSegment での区間の長さ
+
+	// TimeSegment で区間の前から戻ってレンダリングする分も含めた総サンプル数が、全体の長さのこの倍数を超えたら区間を長くする
+	double maxSegmentWorkRatio = 2.0;
+};
+
+// synth の音色で MIDI データ全体を複数のスレッドでレンダリングする
+// 仕事ごとに synth の設定をコピーしたシンセを使うので、synth 自体の状態は変わらない
+// TimeSegment は1スレッドでのレンダリングと同じ結果になる
+// Track と Channel はノートオフの対応づけや足し合わせる順番が変わるので、わずかに異なることがある
+// TimeSegment で区間ごとに大きく戻ってレンダリングし直すことになるときは、区間を長くするか1つの仕事にして stats.fallbackReason に理由を書く
+Wave RenderWaveParallel(const Synthesizer& synth, const MidiData& midiData, const ParallelRenderConfig& config, RenderStats& stats)
+{
+	const auto lengthOfSamples = RenderLengthOfSamples(synth, midiData);
+
+	Wave wave(lengthOfSamples);
+
+	const MidiEventScheduler timeline(midiData, SamplingFreq);
+
+	stats = RenderStats();
+	Stopwatch stopwatch{ StartImmediately::Yes };
+
+	WorkStealingThreadPool threadPool(Max<size_t>(config.threadCount, 1) - 1);
+
+	// TimeSegment の区間ごとの仕事
+	struct SegmentJob
+	{
+		int64 segmentBegin;
+		int64 segmentEnd;
+		int64 renderBegin;
+		int64 renderEnd;
+		MidiEventFilter filter;
+	};
+
+	RenderSplit split = config.split;
+	Array<SegmentJob> segmentJobs;
+
+	if (split == RenderSplit::TimeSegment)
+	{
+		// モノフォニックのグライドとサンプル&ホールドの乱数は前のノートの状態を引き継ぐので、区間ごとに先頭からレンダリングし直すことになる
+		// Track や Channel に分けても状態の引き継ぎ方が変わってしまうので、1つの仕事でレンダリングする
+		const bool carriesState = synth.mono()
+			|| synth.lfoStates().any([](const LFO& lfo) { return lfo.shape() == LFOShape::SampleAndHold; });
+
+		if (carriesState)
+		{
+			split = RenderSplit::Single;
+			stats.fallbackReason = U"mono glide or a sample-and-hold LFO carries state across the whole file, so it was rendered as a single job";
+		}
+		else
+		{
+			// ボイスはリリースが終わったブロックの終わりで解放されるので、その分の余裕を見ておく
+			const auto releaseLength = static_cast<int64>(ceil(synth.adsr().releaseTime * SamplingFreq)) + static_cast<int64>(MaxBlockSize);
+			const auto soundingNotes = GetSoundingNotes(midiData, timeline, releaseLength);
+
+			// segmentLength ごとの仕事を segmentJobs に作り、レンダリングする総サンプル数を返す
+			const auto planSegments = [&](int64 segmentLength)
+			{
+				const auto segmentCount = static_cast<size_t>((lengthOfSamples + segmentLength - 1) / segmentLength);
+
+				int64 renderedSamples = 0;
+				segmentJobs.clear();
+				segmentJobs.reserve(segmentCount);
+
+				for (size_t segmentIndex = 0; segmentIndex < segmentCount; ++segmentIndex)
+				{
+					SegmentJob job;
+					job.segmentBegin = segmentLength * segmentIndex;
+					job.segmentEnd = Min(job.segmentBegin + segmentLength, lengthOfSamples);
+
+					// 区間の先頭で鳴っているノートのうち、最も古いノートオンまで戻ってレンダリングを始める
+					// それより前のノートは区間の先頭までに鳴り終わり、LFO も最後のノートオンでリセットされるので、1スレッドでのレンダリングと同じ状態で区間に入る
+					// ブロックの区切りも1スレッドの場合と揃うように、ノートオンの位置から始めて区間の終わりはブロック1つ分先まで進める
+					job.renderBegin = job.segmentBegin;
+					job.renderEnd = Min<int64>(job.segmentEnd + RenderBlockSize, lengthOfSamples);
+					for (const auto& note : soundingNotes)
+					{
+						if (job.segmentBegin <= note.beginSample)
+						{
+							break;
+						}
+						if (job.segmentBegin < note.endSample)
+						{
+							job.renderBegin = note.beginSample;
+							break;
+						}
+					}
+
+					// renderBegin より前のノートは鳴らさないので、それに対応するノートオフも読み飛ばす
+					for (const auto& note : soundingNotes)
+					{
+						if (job.renderBegin <= note.beginSample)
+						{
+							break;
+						}
+						if (note.noteOffSample && job.renderBegin <= note.noteOffSample.value())
+						{
+							job.filter.ignoredNoteOffs.emplace_back(note.noteOffSample.value(), note.noteNumber);
+						}
+					}
+
+					renderedSamples += job.renderEnd - job.renderBegin;
+					segmentJobs.push_back(std::move(job));
+				}
+
+				return renderedSamples;
+			};
+
+			// 長く伸ばしたノートがあると、多くの区間がそのノートオンまで戻ってレンダリングすることになる
+			// 戻る分が多すぎるうちは区間の長さを倍にしていく（全体を伸ばしたままのノートがあれば、最後は1つの区間になる）
+			const auto initialSegmentLength = Max<int64>(static_cast<int64>(config.segmentSeconds * SamplingFreq), RenderBlockSize);
+			int64 segmentLength = initialSegmentLength;
+			double workRatio = static_cast<double>(planSegments(segmentLength)) / Max<int64>(lengthOfSamples, 1);
+			while (config.maxSegmentWorkRatio < workRatio && 1 < segmentJobs.size())
+			{
+				segmentLength *= 2;
+				workRatio = static_cast<double>(planSegments(segmentLength)) / Max<int64>(lengthOfSamples, 1);
+			}
+
+			if (segmentLength != initialSegmentLength)
+			{
+				stats.fallbackReason = U"held notes made the time segments re-render too much of the file, so the segments were lengthened to {:.1f} s ({} jobs, {:.1f}x the file length)"_fmt(
+					1.0 * segmentLength / SamplingFreq, segmentJobs.size(), workRatio);
+			}
+		}
+	}
+
+	if (split == RenderSplit::TimeSegment)
+	{
+		Array<size_t> peakVoiceCounts(segmentJobs.size(), 0);
+
+		threadPool.parallelFor(segmentJobs.size(), [&](size_t segmentIndex)
+			{
+				auto& job = segmentJobs[segmentIndex];
+
+				Synthesizer jobSynth;
+				jobSynth.copySettings(synth);
+				jobSynth.alignControlGrid(job.renderBegin);
+
+				MidiEventScheduler scheduler = timeline;
+				scheduler.seek(job.renderBegin);
+
+				Wave segmentWave(job.renderEnd - job.renderBegin);
+				RenderRange(jobSynth, midiData, scheduler, job.renderBegin, job.renderEnd, segmentWave.data(), std::move(job.filter), peakVoiceCounts[segmentIndex]);
+
+				std::copy(segmentWave.begin() + (job.segmentBegin - job.renderBegin), segmentWave.begin() + (job.segmentEnd - job.renderBegin), wave.begin() + job.segmentBegin);
+			});
+
+		for (const auto peakVoiceCount : peakVoiceCounts)
+		{
+			stats.peakVoiceCount = Max(stats.peakVoiceCount, peakVoiceCount);
+		}
+	}
+	else
+	{
+		// ノートを含むトラック・チャンネルだけを仕事にする（Single は全てのイベントを使う1つの仕事）
+		Array<MidiEventFilter> filters;
+		if (split == RenderSplit::Single)
+		{
+			filters.emplace_back();
+		}
+		else
+		{
+			for (const auto& event : timeline.events())
+			{
+				if (midiData.tracks()[event.trackIndex].isPercussionTrack() || !std::holds_alternative<NoteOnEvent>(event.data))
+				{
+					continue;
+				}
+
+				MidiEventFilter filter;
+				if (split == RenderSplit::Track)
+				{
+					filter.trackIndex = event.trackIndex;
+				}
+				else
+				{
+					filter.channel = NoteEventChannel(event);
+				}
+
+				if (!filters.any([&](const MidiEventFilter& other) { return other.trackIndex == filter.trackIndex && other.channel == filter.channel; }))
+				{
+					filters.push_back(filter);
+				}
+			}
+
+			// 足し合わせる順番を決めておく
+			filters.sort_by([](const MidiEventFilter& a, const MidiEventFilter& b)
+				{
+					return std::make_pair(a.trackIndex.value_or(0), a.channel.value_or(0)) < std::make_pair(b.trackIndex.value_or(0), b.channel.value_or(0));
+				});
+		}
+
+		Array<Wave> partWaves(filters.size());
+		Array<size_t> peakVoiceCounts(filters.size(), 0);
+
+		// 仕事ごとの最大値は別々の時刻のものなので足し合わせられない。同じ区間での同時発音数を足して、その最大値を全体の値にする
+		const auto blockCount = static_cast<size_t>((lengthOfSamples + RenderBlockSize - 1) / RenderBlockSize);
+		Array<Array<uint16>> blockVoiceCounts(filters.size(), Array<uint16>(blockCount, 0));
+
+		threadPool.parallelFor(filters.size(), [&](size_t jobIndex)
+			{
+				Synthesizer jobSynth;
+				jobSynth.copySettings(synth);
+
+				MidiEventScheduler scheduler = timeline;
+				partWaves[jobIndex] = Wave(lengthOfSamples);
+				RenderRange(jobSynth, midiData, scheduler, 0, lengthOfSamples, partWaves[jobIndex].data(), filters[jobIndex], peakVoiceCounts[jobIndex], &blockVoiceCounts[jobIndex]);
+			});
+
+		for (size_t jobIndex = 0; jobIndex < partWaves.size(); ++jobIndex)
+		{
+			const auto& partWave = partWaves[jobIndex];
+			for (int64 i = 0; i < lengthOfSamples; ++i)
+			{
+				wave[i].left += partWave[i].left;
+				wave[i].right += partWave[i].right;
+			}
+		}
+
+		for (size_t block = 0; block < blockCount; ++block)
+		{
+			size_t voiceCount = 0;
+			for (const auto& jobVoiceCounts : blockVoiceCounts)
+			{
+				voiceCount += jobVoiceCounts[block];
+			}
+			stats.peakVoiceCount = Max(stats.peakVoiceCount, voiceCount);
+		}
+	}
+
+	stats.renderSeconds = stopwatch.sF();
+	stats.audioSeconds = 1.0 * lengthOfSamples / SamplingFreq;
+	stats.samples = lengthOfSamples;
+
+	return wave;
+}
+
+// 2つの波形の差
+struct WaveDiff
+{
+	double maxAbsError = 0;
+	double rmsError = 0;
+	int64 differentSamples = 0;
+	int64 firstDifferentSample = -1; // 全て一致していれば -1
+
+	bool identical() const
+	{
+		return differentSamples == 0;
+	}
+};
+
+WaveDiff CompareWaves(const Wave& a, const Wave& b)
+{
+	WaveDiff diff;
+
+	const auto length = Max(a.size(), b.size());
+	double sumSquared = 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		// 短い方は無音として比べる
+		const auto sampleA = i < a.size() ? a[i] : WaveSample(0, 0);
+		const auto sampleB = i < b.size() ? b[i] : WaveSample(0, 0);
+
+		const double errorLeft = std::abs(static_cast<double>(sampleA.left) - sampleB.left);
+		const double errorRight = std::abs(static_cast<double>(sampleA.right) - sampleB.right);
+
+		if (errorLeft != 0 || errorRight != 0)
+		{
+			if (diff.firstDifferentSample < 0)
+			{
+				diff.firstDifferentSample = static_cast<int64>(i);
+			}
+			++diff.differentSamples;
+		}
+
+		diff.maxAbsError = Max(diff.maxAbsError, Max(errorLeft, errorRight));
+		sumSquared += errorLeft * errorLeft + errorRight * errorRight;
+	}
+
+	if (0 < length)
+	{
+		diff.rmsError = sqrt(sumSquared / (length * 2));
+	}
+
+	return diff;
+}
+
+// 書き込みスレッドと読み込みスレッドが1つずつの場合に使えるロックフリーなリングバッファ
+// 読み書き位置は単調増加させて、2のべき乗サイズの配列にマスクで対応させる
+class AudioRingBuffer
+{
+public:
+
+	AudioRingBuffer() = default;
+
+	explicit AudioRingBuffer(size_t capacity)
+	{
+		reset(capacity);
 	}
 
-	// 現在の出力値: [-1.0, 1.0]
-	double currentLevel() const
+	// 保持できるサンプル数を設定して空にする（読み書きが止まっているときに呼ぶ）
+	void reset(size_t capacity)
 	{
-		return m_currentLevel;
+		m_buffer.assign(std::bit_ceil(Max<size_t>(capacity, 1)), WaveSample(0, 0));
+		m_mask = m_buffer.size() - 1;
+		m_capacity.store(capacity);
+		m_readPos.store(0);
+		m_writePos.store(0);
+		m_underrunCount.store(0);
 	}
 
-	// 周期を設定する
-	void setSeconds(double seconds)
+	// 確保済みの配列の範囲で、保持するサンプル数を変える（再生中でも呼べる）
+	// 今より小さくした場合は、読み込みが進んで収まるまで書き込みが止まる
+	void setCapacity(size_t capacity)
 	{
-		m_seconds = seconds;
+		m_capacity.store(Clamp<size_t>(capacity, 1, m_buffer.size()), std::memory_order_relaxed);
 	}
 
-	// カーブを設定する
-	void setFunction(std::function<double(double)> func)
+	// 書き込み側: 続けて書き込める領域を返す（配列の終端で区切られる）
+	std::span<WaveSample> writableSpan()
 	{
-		m_lfoFunction = func;
+		const size_t writePos = m_writePos.load(std::memory_order_relaxed);
+		const size_t readPos = m_readPos.load(std::memory_order_acquire);
+		const size_t writeIndex = writePos & m_mask;
+		const size_t writableSize = Min(FreeSize(capacity(), writePos - readPos), m_buffer.size() - writeIndex);
+		return std::span<WaveSample>(m_buffer.data() + writeIndex, writableSize);
 	}
 
-	bool isLoop() const
+	// 書き込み側: writableSpan に書き込んだサンプルを読み込み側に公開する
+	void commitWrite(size_t count)
 	{
-		return m_loop;
+		m_writePos.store(m_writePos.load(std::memory_order_relaxed) + count, std::memory_order_release);
 	}
 
-	// ループを有効にする
-	void setLoop(bool isLoop)
+	// 書き込み側: 空いている分だけ書き込んで、書き込んだサンプル数を返す
+	size_t write(const WaveSample* samples, size_t count)
 	{
-		m_loop = isLoop;
+		size_t written = 0;
+		while (written < count)
+		{
+			const auto writable = writableSpan();
+			if (writable.empty())
+			{
+				break;
+			}
+
+			const size_t n = Min(writable.size(), count - written);
+			std::copy_n(samples + written, n, writable.data());
+			commitWrite(n);
+			written += n;
+		}
+		return written;
 	}
 
-private:
+	// 読み込み側: count サンプル読み込む（足りない分は無音で埋めてアンダーランとして数える）
+	void read(float* left, float* right, size_t count)
+	{
+		const size_t readPos = m_readPos.load(std::memory_order_relaxed);
+		const size_t writePos = m_writePos.load(std::memory_order_acquire);
+		const size_t readSize = Min(count, writePos - readPos);
 
-	double m_seconds = 1;
-	bool m_loop = true;
-	std::function<double(double)> m_lfoFunction;
+		for (size_t i = 0; i < readSize; ++i)
+		{
+			const auto& sample = m_buffer[(readPos + i) & m_mask];
+			*left++ = sample.left;
+			*right++ = sample.right;
+		}
 
-	double m_phase = 0;
-	double m_currentLevel = 0;
-};
+		if (readSize < count)
+		{
+			std::fill_n(left, count - readSize, 0.0f);
+			std::fill_n(right, count - readSize, 0.0f);
+			m_underrunCount.fetch_add(1, std::memory_order_relaxed);
+		}
 
-class ModParameter
-{
-public:
+		m_readPos.store(readPos + readSize, std::memory_order_release);
+	}
 
-	ModParameter(double value) : value(value) {}
+	// 読み込み可能なサンプル数
+	size_t size() const
+	{
+		return m_writePos.load(std::memory_order_acquire) - m_readPos.load(std::memory_order_acquire);
+	}
 
-	// 値が書き換わったら true を返す
-	bool fetch(const Array<LFO>& lfoTable)
+	// 書き込み可能なサンプル数
+	size_t freeSize() const
 	{
-		if (m_modIndex)
-		{
-			const double x = lfoTable[m_modIndex.value()].currentLevel();
-			const double newValue = Math::Lerp(m_low, m_high, x * 0.5 + 0.5);
-			if (value != newValue)
-			{
-				value = newValue;
-				return true;
-			}
-		}
+		return FreeSize(capacity(), size());
+	}
 
-		return false;
+	size_t capacity() const
+	{
+		return m_capacity.load(std::memory_order_relaxed);
 	}
 
-	void setRange(double lowValue, double highValue)
+	// setCapacity で設定できる最大のサンプル数
+	size_t maxCapacity() const
 	{
-		m_low = lowValue;
-		m_high = highValue;
+		return m_buffer.size();
 	}
 
-	void setModIndex(int index)
+	size_t readPos() const
 	{
-		m_modIndex = index;
+		return m_readPos.load(std::memory_order_acquire);
 	}
 
-	void unsetModIndex()
+	uint64 underrunCount() const
 	{
-		m_modIndex = none;
+		return m_underrunCount.load(std::memory_order_relaxed);
 	}
 
-	double value = 0;
+	// 確保している配列全体（サイズは2のべき乗）
+	const Array<WaveSample>& data() const
+	{
+		return m_buffer;
+	}
 
 private:
 
-	double m_low = 0;
-	double m_high = 1;
-	Optional<int> m_modIndex;
+	// 容量を縮めた直後は保持しているサンプル数の方が多いことがある
+	static size_t FreeSize(size_t capacity, size_t size)
+	{
+		return size < capacity ? capacity - size : 0;
+	}
+
+	Array<WaveSample> m_buffer;
+	size_t m_mask = 0;
+	std::atomic<size_t> m_capacity = 0;
+
+	std::atomic<size_t> m_readPos = 0;
+	std::atomic<size_t> m_writePos = 0;
+	std::atomic<uint64> m_underrunCount = 0;
 };
 
-float NoteNumberToFrequency(int8_t d)
+// バッファの補充要求から補充完了までにかかった時間
+struct RefillStats
 {
-	return 440.0f * pow(2.0f, (d - 69) / 12.0f);
-}
-
-static constexpr uint32 MaxUnisonSize = 16;
-static const double Semitone = pow(2.0, 1.0 / 12.0) - 1.0;
+	uint64 count = 0;
+	double averageSeconds = 0;
+	double maxSeconds = 0;
+};
 
-struct NoteState
+// AudioRenderer の再生状況
+struct AudioRendererMetrics
 {
-	NoteState()
+	size_t bufferCapacity = 0;		// 再生バッファの長さ（サンプル数）
+	size_t blockSize = 0;			// 一度にレンダリングするサンプル数
+	size_t fillLevel = 0;			// 現在バッファに溜まっているサンプル数
+	size_t minFillLevel = 0;		// getAudio が呼ばれた時点での最小の溜まり具合
+	uint64 underrunCount = 0;		// 再生に波形の生成が間に合わなかった回数
+	RefillStats refill;
+
+	// 再生バッファによる遅延（秒）
+	double latencySeconds() const
 	{
-		for (auto& initialPhase : m_phase)
-		{
-			// 初期位相をランダムに設定する
-			initialPhase = Random(0.0, 2_pi);
-		}
+		return 1.0 * bufferCapacity / SamplingFreq;
 	}
 
-	// ユニゾン波形ごとに進む周波数が異なるので、別々に位相を管理する
-	std::array<double, MaxUnisonSize> m_phase = {};
-	float m_velocity = 1.f;
-	EnvGenerator m_envelope;
+	double fillLevelSeconds() const
+	{
+		return 1.0 * fillLevel / SamplingFreq;
+	}
 };
 
-class Synthesizer
+class AudioRenderer : public IAudioStream
 {
 public:
 
-	Synthesizer()
+	AudioRenderer() :
+		// 上限の長さで確保しておき、再生中は使う範囲だけを変える
+		m_buffer(static_cast<size_t>(MaxTargetLatency * SamplingFreq))
 	{
-		m_detunePitch.fill(1);
-		m_unisonPan.fill(Float2::One().normalize());
+		setTargetLatency(DefaultTargetLatency);
 	}
 
-	// 1サンプル波形を生成して返す
-	WaveSample renderSample()
+	// 再生バッファの長さ（秒）を設定する（再生中でも呼べる）
+	void setTargetLatency(double seconds)
 	{
-		const auto deltaT = 1.0 / SamplingFreq;
-
-		// エンベロープの更新
-		for (auto& [noteNumber, noteState] : m_noteState)
-		{
-			noteState.m_envelope.update(m_adsr, deltaT);
-		}
-
-		// 再生中のノートがあれば LFO を更新する
-		if (!m_noteState.empty())
-		{
-			for (auto& lfoState : m_lfoStates)
-			{
-				lfoState.update(deltaT);
-			}
-		}
-
-		// リリースが終了したノートを削除する
-		std::erase_if(m_noteState, [&](const auto& noteState) { return noteState.second.m_envelope.isReleased(m_adsr); });
-
-		m_pitchShift.fetch(m_lfoStates);
-		const auto pitch = pow(2.0, m_pitchShift.value / 12.0);
-
-		// 入力中の波形を加算して書き込む
-		WaveSample sample(0, 0);
+		m_buffer.setCapacity(Max(LatencyToSamples(seconds), blockSize()));
+	}
 
-		for (auto& [noteNumber, noteState] : m_noteState)
-		{
-			const auto targetFreq = NoteNumberToFrequency(noteNumber);
+	double targetLatency() const
+	{
+		return 1.0 * m_buffer.capacity() / SamplingFreq;
+	}
 
-			if (m_mono && m_glide)
-			{
-				const double targetScale = targetFreq / m_startGlideFreq;
-				const double rate = Saturate(m_glideElapsed / m_glideTime);
-				m_currentFreq = m_startGlideFreq * pow(targetScale, rate);
-				m_glideElapsed += deltaT;
-			}
-			else
-			{
-				m_currentFreq = targetFreq;
-			}
+	// 一度にレンダリングするサンプル数を設定する（再生中でも呼べる）
+	// バッファの空きがこのサイズを超えたときにレンダースレッドを起こす
+	void setBlockSize(size_t blockSize)
+	{
+		m_blockSize.store(Clamp<size_t>(blockSize, 1, m_buffer.capacity()), std::memory_order_relaxed);
+	}
 
-			const auto envLevel = noteState.m_envelope.currentLevel() * noteState.m_velocity;
-			const auto frequency = m_currentFreq * pitch;
+	size_t blockSize() const
+	{
+		return m_blockSize.load(std::memory_order_relaxed);
+	}
 
-			for (int d = 0; d < m_unisonCount; ++d)
-			{
-				const auto detuneFrequency = frequency * m_detunePitch[d];
-				auto& phase = noteState.m_phase[d];
+	// アンダーランが起きない範囲で再生バッファを自動的に短くする
+	void setAdaptiveLatency(bool enabled)
+	{
+		m_adaptiveLatency.store(enabled);
+	}
 
-				const auto osc = OscWaveTables[m_oscIndex].get(phase, detuneFrequency);
-				phase += deltaT * detuneFrequency * Math::TwoPiF;
-				if (Math::TwoPi < phase)
-				{
-					phase -= Math::TwoPi;
-				}
+	bool adaptiveLatency() const
+	{
+		return m_adaptiveLatency.load();
+	}
 
-				const auto w = static_cast<float>(osc * envLevel);
-				sample.left += w * m_unisonPan[d].x;
-				sample.right += w * m_unisonPan[d].y;
-			}
-		}
+	AudioRendererMetrics metrics() const
+	{
+		AudioRendererMetrics metrics;
+		metrics.bufferCapacity = m_buffer.capacity();
+		metrics.blockSize = blockSize();
+		metrics.fillLevel = m_buffer.size();
+		metrics.minFillLevel = Min(m_minFillLevel.load(std::memory_order_relaxed), metrics.bufferCapacity);
+		metrics.underrunCount = m_buffer.underrunCount();
+		metrics.refill = refillStats();
+		return metrics;
+	}
 
-		m_pan.fetch(m_lfoStates);
-		sample.left *= static_cast<float>(cos(Math::HalfPi * m_pan.value));
-		sample.right *= static_cast<float>(sin(Math::HalfPi * m_pan.value));
+	// 最小の溜まり具合と補充時間の統計をリセットする
+	void resetMetrics()
+	{
+		m_minFillLevel.store(SIZE_MAX);
 
-		m_amplitude.fetch(m_lfoStates);
-		return sample * static_cast<float>(m_amplitude.value / sqrt(m_unisonCount));
+		std::lock_guard lock(m_statsMutex);
+		m_refillStats = RefillStats();
 	}
 
-	void noteOn(int8_t noteNumber, int8_t velocity)
+	void setMidiData(const MidiData& midiData)
 	{
-		if (!m_mono || m_noteState.empty())
-		{
-			NoteState noteState;
-			noteState.m_velocity = velocity / 127.0f;
-			m_noteState.emplace(noteNumber, noteState);
-		}
-		else
-		{
-			auto [key, oldState] = *m_noteState.begin();
+		m_midiData = midiData;
+		m_scheduler = MidiEventScheduler(m_midiData, SamplingFreq);
+	}
 
-			// ノート番号が同じとは限らないので一回消して作り直す
-			m_noteState.clear();
+	void restart()
+	{
+		m_synth.clear();
+		m_scheduler.reset();
+		m_readMIDIPos = 0;
+		m_adaptiveStablePos = 0;
+	}
 
-			NoteState noteState = oldState;
-			noteState.m_velocity = velocity / 127.0f;
-			noteState.m_envelope.reset(m_legato ? EnvGenerator::State::Sustain : EnvGenerator::State::Attack);
-			m_noteState.emplace(noteNumber, noteState);
-		}
+	// 次の MIDI イベントかバッファの空きまでの波形をまとめて生成する
+	void bufferBlock()
+	{
+		// 現在位置までに発生した MIDI イベントをシンセに登録
+		m_scheduler.dispatch(static_cast<int64>(m_readMIDIPos), [&](const ScheduledMidiEvent& event) { ApplyMidiEvent(m_synth, m_midiData, event); });
 
-		if (m_mono && m_glide)
+		// リングバッファの終端と次のイベント位置をまたがないように区切る
+		const auto writable = m_buffer.writableSpan();
+		size_t frames = Min(blockSize(), writable.size());
+		if (const auto nextEvent = m_scheduler.nextEventSample())
 		{
-			m_startGlideFreq = m_currentFreq;
-			m_glideElapsed = 0;
+			frames = Min(frames, static_cast<size_t>(nextEvent.value()) - m_readMIDIPos);
 		}
 
-		if (!m_mono)
-		{
-			// LFO の再生状態をリセットする
-			for (auto& lfoState : m_lfoStates)
-			{
-				lfoState.reset();
-			}
-		}
+		m_synth.renderBlock(writable.data(), frames);
+		m_buffer.commitWrite(frames);
+
+		m_readMIDIPos += frames;
 	}
 
-	void noteOff(int8_t noteNumber)
+	bool bufferCompleted() const
 	{
-		auto [beginIt, endIt] = m_noteState.equal_range(noteNumber);
-
-		for (auto it = beginIt; it != endIt; ++it)
-		{
-			auto& envelope = it->second.m_envelope;
-
-			// noteOnになっている最初の要素をnoteOffにする
-			if (envelope.state() != EnvGenerator::State::Release)
-			{
-				envelope.noteOff();
-				break;
-			}
-		}
+		return m_buffer.freeSize() == 0;
 	}
 
-	void updateGUI(Vec2& pos)
+	// レンダースレッド: バッファが埋まるまで波形を生成する
+	void fillBuffer()
 	{
-		SimpleGUI::Slider(U"amplitude : {:.2f}"_fmt(m_amplitude.value), m_amplitude.value, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-		SimpleGUI::Slider(U"pan : {:.2f}"_fmt(m_pan.value), m_pan.value, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-		SliderInt(U"oscillator : {}"_fmt(m_oscIndex), m_oscIndex, 0, 3, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth);
-
-		if (SimpleGUI::Slider(U"pitchShift : {:.2f}"_fmt(m_pitchShift.value), m_pitchShift.value, -24.0, 24.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth)
-			 && KeyControl.pressed())
+		if (m_adaptiveLatency.load(std::memory_order_relaxed))
 		{
-			m_pitchShift.value = Math::Round(m_pitchShift.value);
+			updateAdaptiveLatency();
 		}
-
-		bool unisonUpdated = false;
-		unisonUpdated = SliderInt(U"unisonCount : {}"_fmt(m_unisonCount), m_unisonCount, 1, 16, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth) || unisonUpdated;
-		unisonUpdated = SimpleGUI::Slider(U"detune : {:.2f}"_fmt(m_detune), m_detune, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth) || unisonUpdated;
-		unisonUpdated = SimpleGUI::Slider(U"spread : {:.2f}"_fmt(m_spread), m_spread, 0.0, 1.0, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth, SliderWidth) || unisonUpdated;
-
-		if (unisonUpdated)
+		else
 		{
-			updateUnisonParam();
+			m_adaptiveActive = false;
 		}
 
-		m_adsr.updateGUI(pos);
-
-		const int marginWidth = 32;
+		while (!bufferCompleted())
+		{
+			bufferBlock();
+		}
 
+		// 補充要求が出ていれば、要求から補充完了までの時間を記録する
+		const int64 requestedTime = m_refillRequestedTime.exchange(0, std::memory_order_acq_rel);
+		if (requestedTime != 0)
 		{
-			pos.y += SliderHeight;
-			RectF(pos, LabelWidth + SliderWidth, SliderHeight * (m_mono ? 3 : 1)).draw();
-			SimpleGUI::CheckBox(m_mono, U"mono", pos);
-			if (m_mono)
-			{
-				const auto legatoWidth = SimpleGUI::CheckBoxRegion(U"legato", {}).w;
-				pos.x += marginWidth;
-				SimpleGUI::CheckBox(m_legato, U"legato", Vec2(pos.x, pos.y += SliderHeight));
-				SimpleGUI::CheckBox(m_glide, U"glide", Vec2(pos.x + legatoWidth, pos.y));
-				SimpleGUI::Slider(U"glideTime : {:.2f}"_fmt(m_glideTime), m_glideTime, 0.001, 0.5, Vec2{ pos.x, pos.y += SliderHeight }, LabelWidth - marginWidth, SliderWidth);
-				pos.x -= marginWidth;
-			}
+			const double latency = (SteadyClockNanoseconds() - requestedTime) * 1e-9;
+
+			std::lock_guard lock(m_statsMutex);
+			++m_refillStats.count;
+			m_refillStats.averageSeconds += (latency - m_refillStats.averageSeconds) / m_refillStats.count;
+			m_refillStats.maxSeconds = Max(m_refillStats.maxSeconds, latency);
 		}
 	}
 
-	void clear()
+	// レンダースレッド: 補充要求が来るまで待つ
+	// 通知を取りこぼしても止まらないように、バッファの半分が再生される時間でタイムアウトさせる
+	void waitForRefillRequest()
 	{
-		m_noteState.clear();
-	}
+		const auto timeout = std::chrono::microseconds(m_buffer.capacity() * 500'000 / SamplingFreq);
 
-	ADSRConfig& adsr()
-	{
-		return m_adsr;
+		std::unique_lock lock(m_wakeMutex);
+		m_wakeCondition.wait_for(lock, timeout, [&] { return m_wakeRequested.exchange(false); });
 	}
 
-	Array<LFO>& lfoStates()
+	// 待機中のレンダースレッドを起こす（終了時など）
+	void wakeRenderThread()
 	{
-		return m_lfoStates;
+		m_wakeRequested.store(true);
+		m_wakeCondition.notify_one();
 	}
 
-	int oscIndex() const
+	RefillStats refillStats() const
 	{
-		return m_oscIndex;
+		std::lock_guard lock(m_statsMutex);
+		return m_refillStats;
 	}
-	void setOscIndex(int oscIndex)
+
+	void updateGUI(Vec2& pos)
 	{
-		m_oscIndex = oscIndex;
+		m_synth.updateGUI(pos);
 	}
 
-	const ModParameter& amplitude() const
+	const Array<WaveSample>& buffer() const
 	{
-		return m_amplitude;
+		return m_buffer.data();
 	}
-	ModParameter& amplitude()
+
+	size_t bufferCapacity() const
 	{
-		return m_amplitude;
+		return m_buffer.capacity();
 	}
 
-	const ModParameter& pan() const
+	size_t bufferReadPos() const
 	{
-		return m_pan;
+		return m_buffer.readPos();
 	}
-	ModParameter& pan()
+
+	size_t playingMIDIPos() const
 	{
-		return m_pan;
+		return m_readMIDIPos - m_buffer.size();
 	}
 
-	const ModParameter& pitchShift() const
+	// 再生に波形の生成が間に合わなかった回数
+	uint64 underrunCount() const
 	{
-		return m_pitchShift;
+		return m_buffer.underrunCount();
 	}
-	ModParameter& pitchShift()
+
+	Synthesizer& synth()
 	{
-		return m_pitchShift;
+		return m_synth;
 	}
 
-	int unisonCount() const
+private:
+
+	static size_t LatencyToSamples(double seconds)
 	{
-		return m_unisonCount;
+		return static_cast<size_t>(Clamp(seconds, MinTargetLatency, MaxTargetLatency) * SamplingFreq);
 	}
-	void setUnisonCount(int unisonCount)
+
+	// レンダースレッド: アンダーランの有無を見て再生バッファの長さを調整する
+	// アンダーランが起きたら1.5倍に広げてその長さを下限とし、0.5秒間起きなければ下限との差の1/4（最低1ブロック）ずつ縮める
+	void updateAdaptiveLatency()
 	{
-		m_unisonCount = unisonCount;
-		updateUnisonParam();
+		const uint64 underrunCount = m_buffer.underrunCount();
+		const size_t capacity = m_buffer.capacity();
+
+		if (!m_adaptiveActive)
+		{
+			m_adaptiveActive = true;
+			m_adaptiveFloor = LatencyToSamples(MinTargetLatency);
+			m_adaptiveUnderrunCount = underrunCount;
+			m_adaptiveStablePos = m_readMIDIPos;
+			return;
+		}
+
+		if (m_adaptiveUnderrunCount < underrunCount)
+		{
+			m_adaptiveFloor = Min(capacity + blockSize(), m_buffer.maxCapacity());
+			m_buffer.setCapacity(Max(capacity * 3 / 2, m_adaptiveFloor));
+			m_adaptiveUnderrunCount = underrunCount;
+			m_adaptiveStablePos = m_readMIDIPos;
+		}
+		else if (m_adaptiveStablePos + SamplingFreq / 2 <= m_readMIDIPos)
+		{
+			const size_t lowerLimit = Max(m_adaptiveFloor, blockSize());
+			if (lowerLimit < capacity)
+			{
+				const size_t step = Max((capacity - lowerLimit) / 4, blockSize());
+				m_buffer.setCapacity(Max(capacity - Min(step, capacity), lowerLimit));
+			}
+			m_adaptiveStablePos = m_readMIDIPos;
+		}
 	}
 
-	double detune() const
+	void getAudio(float* left, float* right, const size_t samplesToWrite) override
 	{
-		return m_detune;
+		const size_t fillLevel = m_buffer.size();
+		if (fillLevel < m_minFillLevel.load(std::memory_order_relaxed))
+		{
+			m_minFillLevel.store(fillLevel, std::memory_order_relaxed);
+		}
+
+		m_buffer.read(left, right, samplesToWrite);
+
+		// 空きが1ブロック分を超えたらレンダースレッドを起こす
+		// オーディオスレッドを止めないように、ロックは取らずに通知だけ行う
+		if (blockSize() <= m_buffer.freeSize() && !m_wakeRequested.load(std::memory_order_relaxed))
+		{
+			int64 expected = 0;
+			m_refillRequestedTime.compare_exchange_strong(expected, SteadyClockNanoseconds());
+			wakeRenderThread();
+		}
 	}
-	void setDetune(double detune)
+
+	static int64 SteadyClockNanoseconds()
 	{
-		m_detune = detune;
-		updateUnisonParam();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 	}
 
-	double spread() const
+	bool hasEnded() override { return false; }
+	void rewind() override {}
+
+	Synthesizer m_synth;
+	MidiData m_midiData;
+	MidiEventScheduler m_scheduler;
+	AudioRingBuffer m_buffer;
+	std::atomic<size_t> m_blockSize = RenderBlockSize;
+	std::atomic<size_t> m_minFillLevel = SIZE_MAX;
+	size_t m_readMIDIPos = 0;
+
+	// 再生バッファの自動調整（レンダースレッドからのみ触る）
+	std::atomic<bool> m_adaptiveLatency = false;
+	bool m_adaptiveActive = false;
+	size_t m_adaptiveFloor = 0;
+	uint64 m_adaptiveUnderrunCount = 0;
+	size_t m_adaptiveStablePos = 0;
+
+	std::mutex m_wakeMutex;
+	std::condition_variable m_wakeCondition;
+	std::atomic<bool> m_wakeRequested = false;
+	std::atomic<int64> m_refillRequestedTime = 0;
+
+	mutable std::mutex m_statsMutex;
+	RefillStats m_refillStats;
+};
+
+#if defined(SYNTH_HEADLESS)
+
+// ウィンドウを開かずに MIDI ファイルを WAV に書き出す
+// 使い方: Chapter3_5_LFO [options] input.mid [output.wav]
+//   --parallel=segment|track|channel : 複数のスレッドで区間ごと・トラックごと・チャンネルごとにレンダリングする
+//   --threads=N              : 並列レンダリングのスレッド数
+//   --voice-threads=N        : 1つのシンセのボイスを N スレッドで並列に生成する（--parallel の各仕事には使わない）
+//   --verify                 : 並列レンダリングの結果を1スレッドでのレンダリング結果と比較する
+// 使い方: Chapter3_5_LFO --verify-simd : AVX2 で処理したユニゾン波形がスカラーの処理と許容誤差の範囲で一致するか確かめる
+// 使い方: Chapter3_5_LFO [--threads=N] --parallel-render-test : 長いノートを含む SMF を生成して、区間ごとの並列レンダリングが1スレッドと一致するか確かめる
+// 使い方: Chapter3_5_LFO [--threads=N] --load-dir=DIR   : DIR 以下の .mid を全て読み込んで結果を表示する
+//   --cache-dir=DIR          : 読み込んだ MidiData のキャッシュを DIR に置き、次回からはそちらを使う
+// 使い方: Chapter3_5_LFO [--threads=N] --parse-benchmark : 生成した SMF で読み込みの速さを計測する
+// 使い方: Chapter3_5_LFO --write-wavetables=FILE : 全てのウェーブテーブルを作って FILE に書き出す
+//   --wavetables=FILE        : 書き出したウェーブテーブルを読み込んで使う（読めなければその場で作る）
+//   --lookup=band|mipmap|mipmap-crossfade : ウェーブテーブルの選び方（帯域ごとの補間・オクターブごと・オクターブごと + 補間）
+SIV3D_SET(EngineOption::Renderer::Headless)
+
+// 計測用の SMF を生成する（テンポトラック + ランダムなノートを並べたトラック）
+// maxNoteTicks はノートの長さの上限（480 で1拍）
+Array<uint8> GenerateSyntheticMidi(uint64 seed, size_t trackCount, size_t notesPerTrack, uint32 maxNoteTicks = 480)
+{
+	DefaultRNG rng{ seed };
+
+	Array<uint8> bytes;
+	const auto writeBigEndian = [&](uint32 value, int byteCount)
 	{
-		return m_spread;
-	}
-	void setSpread(double spread)
+		for (int i = byteCount - 1; 0 <= i; --i)
+		{
+			bytes.push_back(static_cast<uint8>(value >> (i * 8)));
+		}
+	};
+	const auto writeVariableLength = [&](uint32 value)
 	{
-		m_spread = spread;
-		updateUnisonParam();
-	}
+		for (int shift = 21; 0 < shift; shift -= 7)
+		{
+			if (value >> shift)
+			{
+				bytes.push_back(static_cast<uint8>(((value >> shift) & 0x7F) | 0x80));
+			}
+		}
+		bytes.push_back(static_cast<uint8>(value & 0x7F));
+	};
 
-	bool mono() const
+	const auto beginTrack = [&]()
 	{
-		return m_mono;
-	}
-	void setMono(bool mono)
+		bytes.insert(bytes.end(), { 'M', 'T', 'r', 'k', 0, 0, 0, 0 });
+		return bytes.size();
+	};
+	const auto endTrack = [&](size_t trackBegin)
 	{
-		m_mono = mono;
-	}
+		bytes.insert(bytes.end(), { 0x00, 0xFF, 0x2F, 0x00 });
+		const auto length = static_cast<uint32>(bytes.size() - trackBegin);
+		for (int i = 0; i < 4; ++i)
+		{
+			bytes[trackBegin - 4 + i] = static_cast<uint8>(length >> ((3 - i) * 8));
+		}
+	};
 
-	bool legato() const
+	bytes.insert(bytes.end(), { 'M', 'T', 'h', 'd' });
+	writeBigEndian(6, 4);
+	writeBigEndian(1, 2);
+	writeBigEndian(static_cast<uint32>(trackCount + 1), 2);
+	writeBigEndian(480, 2);
+
+	// テンポ 120
+	const auto tempoTrack = beginTrack();
+	bytes.insert(bytes.end(), { 0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20 });
+	endTrack(tempoTrack);
+
+	for (size_t track = 0; track < trackCount; ++track)
 	{
-		return m_legato;
+		const auto trackBegin = beginTrack();
+		const auto channel = static_cast<uint8>(track % 9);
+		for (size_t i = 0; i < notesPerTrack; ++i)
+		{
+			const auto noteNumber = static_cast<uint8>(Random(40.0, 90.0, rng));
+			writeVariableLength(static_cast<uint32>(Random(0.0, 240.0, rng)));
+			bytes.insert(bytes.end(), { static_cast<uint8>(0x90 | channel), noteNumber, 100 });
+			// ノートオフはランニングステータス + ベロシティ 0 で書く
+			writeVariableLength(static_cast<uint32>(Random(1.0, static_cast<double>(maxNoteTicks), rng)));
+			bytes.insert(bytes.end(), { noteNumber, 0 });
+		}
+		endTrack(trackBegin);
 	}
-	void setLegato(bool legato)
+
+	return bytes;
+}
+
+void PrintLoadStats(const Array<MidiLoadResult>& results, double seconds, size_t threadCount)
+{
+	int64 totalBytes = 0;
+	size_t failedCount = 0;
+	for (const auto& result : results)
 	{
-		m_legato = legato;
+		totalBytes += result.fileSize;
+		if (!result.midiData)
+		{
+			++failedCount;
+		}
 	}
 
-	bool glide() const
+	Console << U"threads: {}, files: {}, failed: {}, {:.1f} MB in {:.3f} s"_fmt(threadCount, results.size(), failedCount, totalBytes / 1e6, seconds);
+	Console << U"  {:.0f} files/sec, {:.1f} MB/sec"_fmt(results.size() / seconds, totalBytes / 1e6 / seconds);
+}
+
+// 生成した SMF を一時ディレクトリに書き出し、1スレッドと threadCount スレッドで読み込む速さを比べる
+void RunParseBenchmark(size_t threadCount)
+{
+	const FilePath directory = FileSystem::TemporaryDirectoryPath() + U"midi_parse_benchmark/";
+	FileSystem::CreateDirectories(directory);
+
+	constexpr size_t FileCount = 200;
+
+	Array<FilePath> paths;
+	for (size_t i = 0; i < FileCount; ++i)
 	{
-		return m_glide;
+		// 大きさの違うファイルを混ぜる
+		const auto bytes = GenerateSyntheticMidi(i, 1 + i % 16, 500 + (i % 7) * 2000);
+		const FilePath path = directory + U"{:03d}.mid"_fmt(i);
+
+		BinaryWriter writer(path);
+		writer.write(bytes.data(), bytes.size());
+		paths.push_back(path);
 	}
-	void setGlide(bool glide)
+
+	for (const auto threads : { size_t(1), threadCount })
 	{
-		m_glide = glide;
+		Stopwatch stopwatch{ StartImmediately::Yes };
+		const auto results = LoadMidiFiles(paths, threads);
+		PrintLoadStats(results, stopwatch.sF(), threads);
 	}
 
-	double glideTime() const
+	FileSystem::Remove(directory);
+}
+
+// 区間の境目をまたいで押したままのノートがある SMF で、区間ごとの並列レンダリングが1スレッドでのレンダリングと一致するか確かめる
+bool RunParallelRenderTest(size_t threadCount)
+{
+	const FilePath path = FileSystem::TemporaryDirectoryPath() + U"parallel_render_test.mid";
 	{
-		return m_glideTime;
+		// ノートの長さを最大 8 拍（4 秒）にして、1 秒ごとの区間の境目をまたがせる
+		const auto bytes = GenerateSyntheticMidi(0, 4, 12, 480 * 8);
+		BinaryWriter writer(path);
+		writer.write(bytes.data(), bytes.size());
 	}
-	void setGlideTime(double glideTime)
+
+	String errorMessage;
+	const auto midiData = LoadMidi(path, false, &errorMessage);
+	FileSystem::Remove(path);
+	if (!midiData)
 	{
-		m_glideTime = glideTime;
+		Console << U"parallel render test: couldn't load the generated SMF ({})"_fmt(errorMessage);
+		return false;
 	}
 
-private:
+	// 区間を長くせずに 1 秒ごとの区間のままレンダリングさせる
+	ParallelRenderConfig config;
+	config.split = RenderSplit::TimeSegment;
+	config.threadCount = threadCount;
+	config.segmentSeconds = 1.0;
+	config.maxSegmentWorkRatio = std::numeric_limits<double>::infinity();
 
-	void updateUnisonParam()
+	bool passed = true;
+	const auto report = [&](StringView name, const Wave& wave, const Wave& serialWave)
 	{
-		// ユニゾンなし
-		if (m_unisonCount == 1)
+		const auto diff = CompareWaves(wave, serialWave);
+		if (diff.identical())
 		{
-			m_detunePitch.fill(1);
-			m_unisonPan.fill(Float2::One().normalize());
-			return;
+			Console << U"parallel render test ({}): identical"_fmt(name);
+		}
+		else
+		{
+			Console << U"parallel render test ({}): FAILED, {} samples differ (first at {}), max error {:.3g}"_fmt(name, diff.differentSamples, diff.firstDifferentSample, diff.maxAbsError);
+			passed = false;
 		}
+	};
 
-		// ユニゾンあり
-		for (int d = 0; d < m_unisonCount; ++d)
+	// LFO は区間の先頭での状態も一致させる必要があるので、LFO を使う音色でも確かめる
+	for (const bool useLFO : { false, true })
+	{
+		Synthesizer synth;
+		synth.setUnisonCount(4);
+		synth.setDetune(0.3);
+		if (useLFO)
 		{
-			// 各波形の位置を[-1, 1]で計算する
-			const auto detunePos = Math::Lerp(-1.0, 1.0, 1.0 * d / (m_unisonCount - 1));
+			auto& lfoStates = synth.lfoStates();
+			lfoStates.resize(1);
+			lfoStates[0].setShape(LFOShape::Sine);
+			lfoStates[0].setSeconds(0.3);
+			synth.pitchShift().setModIndex(0);
+			synth.pitchShift().setRange(-0.5, 0.5);
+			synth.modMatrix().addRoute({ ModSource::LFO, ModDestination::Pan, 0.3 });
+		}
 
-			// 現在の周波数から最大で Semitone * m_detune だけピッチシフトする
-			m_detunePitch[d] = static_cast<float>(1.0 + Semitone * m_detune * detunePos);
+		RenderStats stats;
+		const auto wave = RenderWaveParallel(synth, midiData.value(), config, stats);
 
-			// Math::QuarterPi が中央
-			const auto unisonAngle = Math::QuarterPi * (1.0 + detunePos * m_spread);
-			m_unisonPan[d] = Float2(cos(unisonAngle), sin(unisonAngle));
+		Synthesizer serialSynth;
+		serialSynth.copySettings(synth);
+		RenderStats serialStats;
+		const auto serialWave = RenderWave(serialSynth, midiData.value(), serialStats);
+
+		report(useLFO ? U"lfo" : U"plain", wave, serialWave);
+	}
+
+	// 戻ってレンダリングする分が多すぎて区間を長くしたときと、モノフォニックで1つの仕事にしたときも一致するか
+	for (const bool mono : { false, true })
+	{
+		Synthesizer synth;
+		synth.setMono(mono);
+
+		ParallelRenderConfig fallbackConfig = config;
+		fallbackConfig.maxSegmentWorkRatio = ParallelRenderConfig().maxSegmentWorkRatio;
+
+		RenderStats stats;
+		const auto wave = RenderWaveParallel(synth, midiData.value(), fallbackConfig, stats);
+
+		Synthesizer serialSynth;
+		serialSynth.copySettings(synth);
+		RenderStats serialStats;
+		const auto serialWave = RenderWave(serialSynth, midiData.value(), serialStats);
+
+		const StringView name = mono ? U"mono" : U"long notes";
+		if (stats.fallbackReason.isEmpty())
+		{
+			Console << U"parallel render test ({}): FAILED, expected the time segments to fall back"_fmt(name);
+			passed = false;
 		}
+		report(name, wave, serialWave);
 	}
 
-	std::multimap<int8_t, NoteState> m_noteState;
+	// ボイスを複数のスレッドで生成しても1スレッドと同じになるか
+	{
+		Synthesizer synth;
+		synth.setUnisonCount(4);
+		synth.setDetune(0.3);
+		synth.setRenderThreadCount(Max<size_t>(threadCount, 2));
 
-	ADSRConfig m_adsr;
+		RenderStats stats;
+		const auto wave = RenderWave(synth, midiData.value(), stats);
 
-	Array<LFO> m_lfoStates;
+		Synthesizer serialSynth;
+		serialSynth.copySettings(synth);
+		RenderStats serialStats;
+		const auto serialWave = RenderWave(serialSynth, midiData.value(), serialStats);
 
-	ModParameter m_amplitude = 0.1;
-	ModParameter m_pan = 0.5;
-	ModParameter m_pitchShift = 0.0;
-	int m_oscIndex = 0;
+		report(U"voice threads", wave, serialWave);
+	}
 
-	int m_unisonCount = 1;
-	double m_detune = 0;
-	double m_spread = 1.0;
+	return passed;
+}
 
-	bool m_mono = false;
-	bool m_legato = false;
-	bool m_glide = false;
-	double m_glideTime = 0.001;
+// AVX2 のカーネル（Synthesizer::renderUnison4）がスカラーのカーネルと許容誤差の範囲で一致するか確かめる
+bool RunSimdVerification()
+{
+#if defined(__AVX2__)
+	// 位相は同じ計算なので一致する
+	// 出力は4波形を足す順番だけが違うので、誤差はユニゾンの波形数（出力の振幅の上限の目安）に対して float の丸め誤差の数倍に収まる
+	// 出力の誤差はユニゾンの波形数で割った値で比べる
+	constexpr double OutputTolerance = 4 * std::numeric_limits<float>::epsilon();
+	constexpr double PhaseTolerance = 0.0;
+	constexpr size_t Frames = SamplingFreq / 10;
+
+	UnisonKernelError maxError;
+	size_t caseCount = 0;
+
+	for (int oscIndex = 0; oscIndex < static_cast<int>(OscWaveTables.size()); ++oscIndex)
+	{
+		for (const auto lookup : { WaveTableLookup::BandCrossfade, WaveTableLookup::Mipmap, WaveTableLookup::MipmapCrossfade })
+		{
+			// 4 の倍数でない数も混ぜて、スカラーで処理する残りの波形がある場合も確かめる
+			for (const int unisonCount : { 4, 7, 16 })
+			{
+				for (const double frequency : { 27.5, 110.0, 440.0, 1760.0, 7040.0, 15000.0 })
+				{
+					Synthesizer synth;
+					synth.setOscIndex(oscIndex);
+					synth.setWaveTableLookup(lookup);
+					synth.setUnisonCount(unisonCount);
+					synth.setDetune(0.5);
+
+					const auto error = synth.compareUnisonKernels(frequency, Frames, caseCount);
+					maxError.maxOutputError = Max(maxError.maxOutputError, error.maxOutputError / unisonCount);
+					maxError.maxPhaseError = Max(maxError.maxPhaseError, error.maxPhaseError);
+					++caseCount;
+				}
+			}
+		}
+	}
 
-	std::array<float, MaxUnisonSize> m_detunePitch;
-	std::array<Float2, MaxUnisonSize> m_unisonPan;
+	const bool passed = (maxError.maxOutputError <= OutputTolerance) && (maxError.maxPhaseError <= PhaseTolerance);
+	Console << U"verify-simd: {} cases, max output error {:.3g} per unison voice (tolerance {:.3g}), max phase error {:.3g} (tolerance {:.3g}): {}"_fmt(
+		caseCount, maxError.maxOutputError, OutputTolerance, maxError.maxPhaseError, PhaseTolerance, passed ? U"ok" : U"FAILED");
+	return passed;
+#else
+	Console << U"verify-simd: AVX2 is not enabled in this build";
+	return true;
+#endif
+}
 
-	double m_currentFreq = 440; //現在の周波数を常に保存しておく
-	double m_startGlideFreq = 440; // グライド開始時の周波数
-	double m_glideElapsed = 0.0; // グライド開始から経過した秒数
-};
+// 使い方を表示する（オプションを追加したらファイル先頭のコメントと README にも書く）
+void PrintUsage()
+{
+	Console << U"usage: Chapter3_5_LFO [options] input.mid [output.wav]";
+	Console << U"       Chapter3_5_LFO --verify-simd";
+	Console << U"       Chapter3_5_LFO [--threads=N] --parallel-render-test";
+	Console << U"       Chapter3_5_LFO [--threads=N] --load-dir=DIR";
+	Console << U"       Chapter3_5_LFO [--threads=N] --parse-benchmark";
+	Console << U"       Chapter3_5_LFO --write-wavetables=FILE";
+	Console << U"options:";
+	Console << U"  --parallel=segment|track|channel       render on several threads, split by time segment, track or channel";
+	Console << U"  --threads=N                            thread count for --parallel";
+	Console << U"  --voice-threads=N                      render the voices of one synth on N threads";
+	Console << U"  --verify                               compare the output with a single-threaded render";
+	Console << U"  --lookup=band|mipmap|mipmap-crossfade  wavetable lookup mode";
+	Console << U"  --wavetables=FILE                      load a wavetable bank file (tables that fail to load are generated)";
+	Console << U"  --write-wavetables=FILE                build every wavetable bank and write it to FILE";
+	Console << U"  --verify-simd                          check the AVX2 unison kernel against the scalar kernel";
+	Console << U"  --parallel-render-test                 check segment-parallel rendering against the serial render";
+	Console << U"  --load-dir=DIR                         load every .mid under DIR in parallel and print the results";
+	Console << U"  --cache-dir=DIR                        keep parsed MIDI data in DIR and reuse it on the next load";
+	Console << U"  --parse-benchmark                      measure SMF parse speed on generated files";
+}
 
-class AudioRenderer : public IAudioStream
+void PrintRenderStats(const RenderStats& stats)
 {
-public:
+	Console << U"audio length: {:.2f} s"_fmt(stats.audioSeconds);
+	Console << U"render time: {:.3f} s"_fmt(stats.renderSeconds);
+	Console << U"realtime factor: {:.1f}x"_fmt(stats.realtimeFactor());
+	Console << U"samples/sec: {:.0f}"_fmt(stats.samplesPerSecond());
+	Console << U"peak voices: {}"_fmt(stats.peakVoiceCount);
+	if (!stats.fallbackReason.isEmpty())
+	{
+		Console << U"warning: {}"_fmt(stats.fallbackReason);
+	}
+}
+
+void Main()
+{
+	Array<String> paths;
+	Optional<ParallelRenderConfig> parallelConfig;
+	Optional<size_t> threadCount;
+	Optional<size_t> voiceThreadCount;
+	bool verify = false;
+	bool parseBenchmark = false;
+	bool parallelRenderTest = false;
+	bool verifySimd = false;
+	Optional<FilePath> loadDirectory;
+	Optional<FilePath> cacheDirectory;
+	Optional<FilePath> waveTablePath;
+	Optional<FilePath> writeWaveTablePath;
+	WaveTableLookup waveTableLookup = WaveTableLookup::BandCrossfade;
+
+	const auto args = System::GetCommandLineArgs();
+	for (size_t i = 1; i < args.size(); ++i)
+	{
+		const auto& arg = args[i];
+		if (arg == U"--parallel=segment" || arg == U"--parallel=track" || arg == U"--parallel=channel")
+		{
+			parallelConfig = ParallelRenderConfig();
+			parallelConfig->split = (arg == U"--parallel=track") ? RenderSplit::Track
+				: (arg == U"--parallel=channel") ? RenderSplit::Channel
+				: RenderSplit::TimeSegment;
+		}
+		else if (arg == U"--parallel-render-test")
+		{
+			parallelRenderTest = true;
+		}
+		else if (arg == U"--verify-simd")
+		{
+			verifySimd = true;
+		}
+		else if (arg.starts_with(U"--threads="))
+		{
+			threadCount = ParseOr<size_t>(arg.substr(10), 1);
+		}
+		else if (arg.starts_with(U"--voice-threads="))
+		{
+			voiceThreadCount = ParseOr<size_t>(arg.substr(16), 1);
+		}
+		else if (arg == U"--verify")
+		{
+			verify = true;
+		}
+		else if (arg == U"--parse-benchmark")
+		{
+			parseBenchmark = true;
+		}
+		else if (arg.starts_with(U"--load-dir="))
+		{
+			loadDirectory = arg.substr(11);
+		}
+		else if (arg.starts_with(U"--cache-dir="))
+		{
+			cacheDirectory = arg.substr(12);
+		}
+		else if (arg.starts_with(U"--wavetables="))
+		{
+			waveTablePath = arg.substr(13);
+		}
+		else if (arg == U"--lookup=band" || arg == U"--lookup=mipmap" || arg == U"--lookup=mipmap-crossfade")
+		{
+			waveTableLookup = (arg == U"--lookup=band") ? WaveTableLookup::BandCrossfade
+				: (arg == U"--lookup=mipmap") ? WaveTableLookup::Mipmap
+				: WaveTableLookup::MipmapCrossfade;
+		}
+		else if (arg.starts_with(U"--write-wavetables="))
+		{
+			writeWaveTablePath = arg.substr(19);
+		}
+		else
+		{
+			paths.push_back(arg);
+		}
+	}
 
-	AudioRenderer()
+	if (writeWaveTablePath)
 	{
-		// 100ms分のバッファを確保する
-		const size_t bufferSize = SamplingFreq / 10;
-		m_buffer.resize(bufferSize);
+		if (!WaveTableBankFile::Write(writeWaveTablePath.value()))
+		{
+			Console << U"error: couldn't write \"{}\""_fmt(writeWaveTablePath.value());
+			return;
+		}
+		Console << U"wavetables: {}"_fmt(writeWaveTablePath.value());
+		return;
 	}
 
-	void setMidiData(const MidiData& midiData)
+	if (waveTablePath)
 	{
-		m_midiData = midiData;
+		String errorMessage;
+		if (!OscWaveTableBankFile.load(waveTablePath.value(), &errorMessage))
+		{
+			// 読めなくても各テーブルはその場で作られるので続ける
+			Console << U"warning: couldn't load \"{}\" ({}), generating wavetables"_fmt(waveTablePath.value(), errorMessage);
+		}
 	}
 
-	void restart()
+	if (verifySimd)
 	{
-		m_synth.clear();
-		m_readMIDIPos = 0;
+		RunSimdVerification();
+		return;
 	}
 
-	void bufferSample()
+	if (parallelRenderTest)
 	{
-		const double currentTime = 1.0 * m_readMIDIPos / SamplingFreq;
-		const double nextTime = 1.0 * (m_readMIDIPos + 1) / SamplingFreq;
+		RunParallelRenderTest(threadCount.value_or(Max(std::thread::hardware_concurrency(), 1u)));
+		return;
+	}
 
-		const auto currentTick = m_midiData.secondsToTicks(currentTime);
-		const auto nextTick = m_midiData.secondsToTicks(nextTime);
+	if (parseBenchmark)
+	{
+		RunParseBenchmark(threadCount.value_or(Max(std::thread::hardware_concurrency(), 1u)));
+		return;
+	}
 
-		// tick が進んだら MIDI イベントの処理を更新する
-		if (currentTick != nextTick)
+	if (loadDirectory)
+	{
+		Array<FilePath> midiPaths;
+		for (const auto& path : FileSystem::DirectoryContents(loadDirectory.value()))
 		{
-			for (const auto& track : m_midiData.tracks())
+			if (FileSystem::Extension(path) == U"mid")
 			{
-				if (track.isPercussionTrack())
-				{
-					continue;
-				}
-
-				// 発生したノートオフイベントをシンセに登録
-				const auto noteOffEvents = track.getMIDIEvent<NoteOffEvent>(currentTick, nextTick);
-				for (auto& [tick, noteOff] : noteOffEvents)
-				{
-					m_synth.noteOff(noteOff.note_number);
-				}
-
-				// 発生したノートオンイベントをシンセに登録
-				const auto noteOnEvents = track.getMIDIEvent<NoteOnEvent>(currentTick, nextTick);
-				for (auto& [tick, noteOn] : noteOnEvents)
-				{
-					m_synth.noteOn(noteOn.note_number, noteOn.velocity);
-				}
+				midiPaths.push_back(path);
 			}
 		}
 
-		const size_t writeIndex = m_bufferWritePos % m_buffer.size();
+		const size_t threads = threadCount.value_or(Max(std::thread::hardware_concurrency(), 1u));
 
-		m_buffer[writeIndex] = m_synth.renderSample();
+		Stopwatch stopwatch{ StartImmediately::Yes };
+		const auto results = LoadMidiFiles(midiPaths, threads, cacheDirectory);
+		const auto seconds = stopwatch.sF();
 
-		++m_bufferWritePos;
-		++m_readMIDIPos;
+		for (const auto& result : results)
+		{
+			if (!result.midiData)
+			{
+				Console << U"{}: {}"_fmt(result.path, result.errorMessage);
+			}
+		}
+		PrintLoadStats(results, seconds, threads);
+		return;
 	}
 
-	bool bufferCompleted() const
+	if (paths.empty())
 	{
-		return m_bufferReadPos + m_buffer.size() - 1 < m_bufferWritePos;
+		PrintUsage();
+		return;
 	}
 
-	void updateGUI(Vec2& pos)
+	const FilePath inputPath = paths[0];
+	const FilePath outputPath = (2 <= paths.size()) ? paths[1] : FilePath(U"output.wav");
+
+	// ボイスの並列化だけを指定したときは、そのまま1スレッドでのレンダリングと比べる
+	if (verify && !parallelConfig && !voiceThreadCount)
 	{
-		m_synth.updateGUI(pos);
+		parallelConfig = ParallelRenderConfig();
 	}
-
-	const Array<WaveSample>& buffer() const
+	if (parallelConfig && threadCount)
 	{
-		return m_buffer;
+		parallelConfig->threadCount = threadCount.value();
 	}
 
-	size_t bufferReadPos() const
+	String errorMessage;
+	auto midiDataOpt = cacheDirectory
+		? LoadMidiCached(inputPath, cacheDirectory.value(), &errorMessage)
+		: LoadMidi(inputPath, false, &errorMessage);
+	if (!midiDataOpt)
 	{
-		return m_bufferReadPos;
+		Console << U"error: couldn't load \"{}\" ({})"_fmt(inputPath, errorMessage);
+		return;
 	}
 
-	size_t playingMIDIPos() const
+	Synthesizer synth;
+	synth.setWaveTableLookup(waveTableLookup);
+	if (voiceThreadCount)
 	{
-		return m_readMIDIPos - (m_bufferWritePos - m_bufferReadPos);
+		synth.setRenderThreadCount(voiceThreadCount.value());
 	}
 
-	Synthesizer& synth()
+	RenderStats stats;
+	const auto wave = parallelConfig
+		? RenderWaveParallel(synth, midiDataOpt.value(), parallelConfig.value(), stats)
+		: RenderWave(synth, midiDataOpt.value(), stats);
+
+	if (!wave.save(outputPath))
 	{
-		return m_synth;
+		Console << U"error: couldn't write \"{}\""_fmt(outputPath);
+		return;
 	}
 
-private:
+	Console << U"output: {}"_fmt(outputPath);
+	if (parallelConfig)
+	{
+		Console << U"threads: {}"_fmt(parallelConfig->threadCount);
+	}
+	if (voiceThreadCount)
+	{
+		Console << U"voice threads: {}"_fmt(synth.renderThreadCount());
+	}
+	PrintRenderStats(stats);
 
-	void getAudio(float* left, float* right, const size_t samplesToWrite) override
+	if (verify)
 	{
-		for (size_t i = 0; i < samplesToWrite; ++i)
-		{
-			const auto& readSample = m_buffer[(m_bufferReadPos + i) % m_buffer.size()];
+		// 同じ音色の新しいシンセで1スレッドでレンダリングして比べる
+		Synthesizer serialSynth;
+		serialSynth.copySettings(synth);
 
-			*left++ = readSample.left;
-			*right++ = readSample.right;
-		}
+		RenderStats serialStats;
+		const auto serialWave = RenderWave(serialSynth, midiDataOpt.value(), serialStats);
+		const auto diff = CompareWaves(wave, serialWave);
 
-		m_bufferReadPos += samplesToWrite;
+		Console << U"serial render time: {:.3f} s (speedup {:.2f}x)"_fmt(serialStats.renderSeconds, serialStats.renderSeconds / stats.renderSeconds);
+		if (diff.identical())
+		{
+			Console << U"verify: identical";
+		}
+		else
+		{
+			Console << U"verify: {} samples differ (first at {}), max error {:.3g}, rms error {:.3g}"_fmt(diff.differentSamples, diff.firstDifferentSample, diff.maxAbsError, diff.rmsError);
+		}
 	}
+}
 
-	bool hasEnded() override { return false; }
-	void rewind() override {}
-
-	Synthesizer m_synth;
-	MidiData m_midiData;
-	Array<WaveSample> m_buffer;
-	size_t m_readMIDIPos = 0;
-	size_t m_bufferReadPos = 0;
-	size_t m_bufferWritePos = 0;
-};
+#else
 
 void Main()
 {
+	// 書き出し済みのテーブルがあれば使い、無ければ裏で作っておく
+	if (FileSystem::Exists(U"wavetables.bin"))
+	{
+		OscWaveTableBankFile.load(U"wavetables.bin");
+	}
+
+	WaveTablePrewarmer waveTablePrewarmer;
+	waveTablePrewarmer.start();
+
 	Window::Resize(1600, 900);
 
 	auto midiDataOpt = LoadMidi(U"glide_test.mid");
@@ -970,7 +4210,7 @@ void Main()
 
 	auto& lfoStates = synth.lfoStates();
 	lfoStates.resize(1);
-	lfoStates[0].setFunction(Sin);
+	lfoStates[0].setShape(LFOShape::Sine);
 	lfoStates[0].setSeconds(0.1);
 	lfoStates[0].setLoop(true);
 
@@ -991,12 +4231,8 @@ void Main()
 				requestRestart = false;
 			}
 
-			while (!audioStream->bufferCompleted())
-			{
-				audioStream->bufferSample();
-			}
-
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			audioStream->fillBuffer();
+			audioStream->waitForRefillRequest();
 		}
 	};
 
@@ -1018,7 +4254,7 @@ void Main()
 			const auto& streamBuffer = audioStream->buffer();
 			const auto readStartPos = audioStream->bufferReadPos();
 
-			const auto fftInputSize = Min(visualizeBuffer.size(), streamBuffer.size());
+			const auto fftInputSize = Min(visualizeBuffer.size(), audioStream->bufferCapacity());
 
 			for (size_t i = 0; i < fftInputSize; ++i)
 			{
@@ -1050,5 +4286,8 @@ void Main()
 	}
 
 	isRunning = false;
+	audioStream->wakeRenderThread();
 	audioRenderThread.join();
 }
+
+#endif
@@ -1,5 +1,7 @@
 ﻿#pragma once
 #include <Siv3D.hpp> // OpenSiv3D v0.6.4
+#include <atomic>
+#include <filesystem>
 
 struct ControlChangeData
 {
@@ -151,12 +153,17 @@ class TrackData
 {
 public:
 
-	TrackData(const Array<MidiCode>& operations) : m_operations(operations)
+	TrackData(const Array<MidiCode>& operations)
 	{
-		init();
+		init(Array<MidiCode>(operations));
 	}
 
-	void init();
+	TrackData(Array<MidiCode>&& operations)
+	{
+		init(std::move(operations));
+	}
+
+	void init(Array<MidiCode>&& operations);
 
 	uint8 channel() const { return m_channel; }
 
@@ -164,8 +171,9 @@ public:
 
 	bool isPercussionTrack() const { return m_channel == 9; }
 
+	// [tickBegin, tickEnd) の範囲のイベントを返す（内部配列を参照するのでコピーは発生しない）
 	template<class T>
-	std::multimap<int64, T> getMIDIEvent(int64 tickBegin, int64 tickEnd) const
+	std::span<const std::pair<int64, T>> getMIDIEvent(int64 tickBegin, int64 tickEnd) const
 	{
 		if constexpr (std::is_same_v<NoteOnEvent, T>)
 		{
@@ -200,28 +208,47 @@ public:
 private:
 
 	friend class MidiData;
+	friend class MidiEventScheduler;
+	friend class MidiDataCache;
+
+	// MidiDataCache で復元するときだけ使う
+	TrackData() = default;
+
+	// SMF から読み込んだトラックのイベント配列の実体
+	struct Storage
+	{
+		Array<MidiCode> operations;
+		Array<std::pair<int64, NoteOnEvent>> noteOnEvents;
+		Array<std::pair<int64, NoteOffEvent>> noteOffEvents;
+		Array<std::pair<int64, PolyphonicKeyPressureEvent>> polyphonicKeyPressureEvents;
+		Array<std::pair<int64, ControlChangeEvent>> controlChangeEvents;
+		Array<std::pair<int64, ProgramChangeEvent>> programChangeEvents;
+		Array<std::pair<int64, PitchBendEvent>> pitchBendEvents;
+	};
 
+	// tick 順に並んだ配列から [tickBegin, tickEnd) の範囲を二分探索で取り出す
 	template<class T>
-	std::multimap<int64, T> filterNoteEvent(const std::multimap<int64, T>& eventList, int64 tickBegin, int64 tickEnd) const
+	std::span<const std::pair<int64, T>> filterNoteEvent(std::span<const std::pair<int64, T>> eventList, int64 tickBegin, int64 tickEnd) const
 	{
-		std::multimap<int64, T> result;
-		auto itBegin = eventList.lower_bound(tickBegin);
-		auto itEnd = eventList.lower_bound(tickEnd);
-		for (auto it = itBegin; it != itEnd; ++it)
-		{
-			result.emplace(it->first, it->second);
-		}
-		return result;
+		const auto compareTick = [](const std::pair<int64, T>& event, int64 tick) { return event.first < tick; };
+		const auto itBegin = std::lower_bound(eventList.begin(), eventList.end(), tickBegin, compareTick);
+		const auto itEnd = std::lower_bound(itBegin, eventList.end(), tickEnd, compareTick);
+		return eventList.subspan(static_cast<size_t>(itBegin - eventList.begin()), static_cast<size_t>(itEnd - itBegin));
 	}
 
-	std::multimap<int64, NoteOnEvent> m_noteOnEvents;
-	std::multimap<int64, NoteOffEvent> m_noteOffEvents;
-	std::multimap<int64, PolyphonicKeyPressureEvent> m_polyphonicKeyPressureEvents;
-	std::multimap<int64, ControlChangeEvent> m_controlChangeEvent;
-	std::multimap<int64, ProgramChangeEvent> m_programChangeEvent;
-	std::multimap<int64, PitchBendEvent> m_pitchBendEvent;
+	// イベント配列の実体（Storage か、キャッシュから復元したときはマップしたキャッシュファイル）
+	// 作った後は書き換えないので、トラックをコピーしたときは共有する
+	std::shared_ptr<const void> m_storage;
 
-	Array<MidiCode> m_operations;
+	// 各イベントは tick 順に並べて保持する
+	std::span<const std::pair<int64, NoteOnEvent>> m_noteOnEvents;
+	std::span<const std::pair<int64, NoteOffEvent>> m_noteOffEvents;
+	std::span<const std::pair<int64, PolyphonicKeyPressureEvent>> m_polyphonicKeyPressureEvents;
+	std::span<const std::pair<int64, ControlChangeEvent>> m_controlChangeEvent;
+	std::span<const std::pair<int64, ProgramChangeEvent>> m_programChangeEvent;
+	std::span<const std::pair<int64, PitchBendEvent>> m_pitchBendEvent;
+
+	std::span<const MidiCode> m_operations;
 
 	uint8 m_channel = 0;
 	uint8 m_program = 0;
@@ -245,6 +272,65 @@ struct Measure
 	void outputLog() const;
 };
 
+// テンポが一定の区間
+struct TempoSegment
+{
+	int64 tick;			// 区間の開始 tick
+	double seconds;		// 区間の開始時刻（秒）
+	double bpm;
+	double secPerTick;	// 1 tick あたりの秒数
+	double ticksPerSec;	// 1 秒あたりの tick 数
+};
+
+// テンポ変更ごとの累積時間を保持して、tick と秒の変換を二分探索で行う
+class TempoMap
+{
+public:
+
+	TempoMap() = default;
+
+	// bpmSetEvents: tick -> BPM
+	TempoMap(const std::map<int64, double>& bpmSetEvents, uint16 resolution);
+
+	size_t segmentIndexAtTick(double tick) const;
+
+	size_t segmentIndexAtSeconds(double seconds) const;
+
+	double ticksToSeconds(double tick) const;
+
+	double secondsToTicks(double seconds) const;
+
+	const Array<TempoSegment>& segments() const { return m_segments; }
+
+private:
+
+	friend class MidiDataCache;
+
+	Array<TempoSegment> m_segments;
+};
+
+// 単調に進む再生位置に対して tick と秒の変換を償却 O(1) で行う
+// 位置が戻った場合は二分探索で区間を探し直す
+class TempoCursor
+{
+public:
+
+	TempoCursor() = default;
+
+	explicit TempoCursor(const TempoMap& tempoMap) : m_tempoMap(&tempoMap) {}
+
+	void reset() { m_index = 0; }
+
+	double ticksToSeconds(double tick);
+
+	double secondsToTicks(double seconds);
+
+private:
+
+	const TempoMap* m_tempoMap = nullptr;
+	size_t m_index = 0;
+};
+
 class MidiData
 {
 public:
@@ -252,8 +338,15 @@ public:
 	MidiData() = default;
 
 	MidiData(const Array<TrackData>& tracks, uint16 resolution) :
-		m_tracks(tracks),
-		m_resolution(resolution)
+		m_resolution(resolution),
+		m_tracks(tracks)
+	{
+		init();
+	}
+
+	MidiData(Array<TrackData>&& tracks, uint16 resolution) :
+		m_resolution(resolution),
+		m_tracks(std::move(tracks))
 	{
 		init();
 	}
@@ -280,8 +373,12 @@ public:
 
 	int64 lengthSample(uint32 sampleRate) const;
 
+	const TempoMap& tempoMap() const { return m_tempoMap; }
+
 private:
 
+	friend class MidiDataCache;
+
 	// tick -> BPM
 	std::map<int64, double> BPMSetEvents() const;
 
@@ -301,48 +398,212 @@ private:
 
 	Array<MeasureInfo> m_measures;
 
-	std::map<int64, double> m_bpmSetEvents;
+	TempoMap m_tempoMap;
 };
 
-Optional<MidiData> LoadMidi(FilePathView path);
+struct ScheduledMidiEvent
+{
+	int64 sampleIndex;
+	uint32 trackIndex;
+	MidiEventData data;
+};
 
-inline uint8 ReadByte(BinaryReader& reader)
+// 全トラックの MIDI イベントを発生サンプル位置順に並べたタイムライン
+class MidiEventScheduler
 {
-	uint8 byte[1] = {};
-	reader.read(byte, 1);
-	return byte[0];
-}
+public:
+
+	MidiEventScheduler() = default;
+
+	MidiEventScheduler(const MidiData& midiData, uint32 sampleRate);
+
+	// 再生位置を先頭に戻す
+	void reset() { m_cursor = 0; }
+
+	// sampleIndex 以降に発生するイベントの位置まで再生位置を移動する
+	void seek(int64 sampleIndex);
+
+	// 次に発生するイベントのサンプル位置を返す（残りのイベントが無ければ none）
+	Optional<int64> nextEventSample() const
+	{
+		if (m_cursor < m_events.size())
+		{
+			return m_events[m_cursor].sampleIndex;
+		}
+		return none;
+	}
+
+	// sampleIndex までに発生するイベントを順番に callback に渡して再生位置を進める
+	template<class Callback>
+	void dispatch(int64 sampleIndex, Callback callback)
+	{
+		while (m_cursor < m_events.size() && m_events[m_cursor].sampleIndex <= sampleIndex)
+		{
+			callback(m_events[m_cursor]);
+			++m_cursor;
+		}
+	}
 
-template<typename T>
-inline T ReadBytes(BinaryReader& reader)
+	const Array<ScheduledMidiEvent>& events() const { return m_events; }
+
+private:
+
+	Array<ScheduledMidiEvent> m_events;
+	size_t m_cursor = 0;
+};
+
+// タスクをスレッドごとのキューに振り分け、手が空いたスレッドが他のキューから盗んで処理するスレッドプール
+// parallelFor ではメモリの確保もロックもしないので、オーディオスレッドから毎ブロック呼び出せる
+class WorkStealingThreadPool
 {
-	uint8 bytes[sizeof(T)] = {};
-	reader.read(bytes, sizeof(T));
-	T value = 0;
-	for (size_t i = 0; i < sizeof(T); i++)
+public:
+
+	// workerCount == 0 のときは呼び出し元のスレッドだけで処理する
+	explicit WorkStealingThreadPool(size_t workerCount = 0);
+
+	~WorkStealingThreadPool();
+
+	WorkStealingThreadPool(const WorkStealingThreadPool&) = delete;
+	WorkStealingThreadPool& operator=(const WorkStealingThreadPool&) = delete;
+
+	// 呼び出し元のスレッドを除いたワーカースレッドの数
+	size_t workerCount() const { return m_workers.size(); }
+
+	// [0, taskCount) の各インデックスについて task(index) を呼び出し、全て終わるまで待つ
+	// 呼び出し元のスレッドも処理に参加する（同時に複数のスレッドから呼ばない）
+	template<class Task>
+	void parallelFor(size_t taskCount, Task&& task)
 	{
-		value += (bytes[i] << ((sizeof(T) - i - 1) * 8));
+		if (m_workers.empty() || taskCount <= 1)
+		{
+			for (size_t i = 0; i < taskCount; ++i)
+			{
+				task(i);
+			}
+			return;
+		}
+
+		run(taskCount, const_cast<void*>(static_cast<const void*>(std::addressof(task))),
+			[](void* context, size_t index) { (*static_cast<std::remove_reference_t<Task>*>(context))(index); });
 	}
-	return value;
-}
 
-inline std::string ReadText(BinaryReader& reader)
+private:
+
+	using TaskFunction = void(*)(void*, size_t);
+
+	// キューの k 番目のタスクはインデックス (キューの番号 + k * キューの数)
+	// 中身は決まっているので、残っている範囲 [head, tail) だけを1つの atomic に詰めて持つ（上位32ビットが head、下位32ビットが tail）
+	// 持ち主は先頭から、他のスレッドは末尾から compare_exchange で取り出す
+	struct alignas(64) TaskQueue
+	{
+		std::atomic<uint64> range = 0;
+
+		void reset(uint32 count) { range.store(count, std::memory_order_release); }
+
+		// 先頭から k を1つ取り出す（空なら none）
+		Optional<uint32> popFront();
+
+		// 末尾から k を1つ取り出す（空なら none）
+		Optional<uint32> popBack();
+	};
+
+	void run(size_t taskCount, void* context, TaskFunction function);
+
+	void workerLoop(size_t queueIndex);
+
+	// キューからタスクを1つ取り出して処理する（取り出せなければ false）
+	bool processTask(size_t queueIndex);
+
+	Array<std::thread> m_workers;
+	std::unique_ptr<TaskQueue[]> m_queues; // [0] は呼び出し元、[1..] はワーカー用
+
+	void* m_context = nullptr;
+	TaskFunction m_function = nullptr;
+	std::atomic<size_t> m_pendingCount = 0;
+
+	// run() のたびに増やしてワーカーを起こす
+	std::atomic<uint64> m_generation = 0;
+	std::atomic<bool> m_stop = false;
+};
+
+// SMF を読み込む（logDiagnostics が true ならメタイベントなどの内容を Logger に出力する）
+// 失敗したときは errorMessage に理由を書き込む
+Optional<MidiData> LoadMidi(FilePathView path, bool logDiagnostics = false, String* errorMessage = nullptr);
+
+// メモリ上の SMF のバイト列から読み込む
+Optional<MidiData> LoadMidiFromMemory(std::span<const uint8> bytes, bool logDiagnostics = false, String* errorMessage = nullptr);
+
+struct MidiLoadResult
 {
-	const uint8 length = ReadBytes<uint8>(reader);
-	Array<char> chars(length + 1ull, '\0');
-	reader.read(chars.data(), length);
-	return std::string(chars.data());
-}
+	FilePath path;
+	Optional<MidiData> midiData;
+	String errorMessage; // 読み込みに失敗したときの理由
+	int64 fileSize = 0;
+};
+
+// 複数の SMF を threadCount 個のスレッドで読み込む（結果は paths と同じ順に並ぶ）
+Array<MidiLoadResult> LoadMidiFiles(const Array<FilePath>& paths, size_t threadCount = Max(std::thread::hardware_concurrency(), 1u), const Optional<FilePath>& cacheDirectory = none);
 
-inline uint32 GetTick(const Array<uint8>& tickBytes)
+// 読み込み済みの MidiData（イベント配列・テンポマップ・拍子）をそのまま保存したバイナリキャッシュ
+// 構造体をそのまま書き出すので、同じコンパイラ・標準ライブラリでビルドしたものでのみ有効（合わなければ読み込みに失敗する）
+// 復元した MidiData のイベント配列はキャッシュのバイト列を直接参照する
+class MidiDataCache
 {
-	uint32 value = 0;
-	for (size_t i = 0; i < tickBytes.size(); i++)
+public:
+
+	static constexpr uint32 Version = 3;
+
+	// 元の SMF のバイト列のハッシュ（キャッシュの照合に使う）
+	static uint64 SourceHash(std::span<const uint8> smfBytes);
+
+	// コンパイラと標準ライブラリの識別子のハッシュ（std::variant などのメモリ上の表現はこれで決まる）
+	static uint64 BuildHash();
+
+	static Array<uint8> Serialize(const MidiData& midiData, uint64 sourceHash);
+
+	// 形式・ハッシュ・チェックサムを検証してから復元する（合わなければ none）
+	// イベント配列は bytes を指すので、bytes の実体を保持している storage を MidiData に持たせる
+	static Optional<MidiData> Deserialize(std::span<const uint8> bytes, uint64 sourceHash, std::shared_ptr<const void> storage);
+
+private:
+
+	struct Header
 	{
-		value += ((tickBytes[i] & 0x7F) << ((tickBytes.size() - i - 1) * 7));
-	}
-	return value;
-}
+		char magic[4];
+		uint32 version;
+		uint64 sourceHash;
+		uint64 payloadSize;
+		uint64 payloadHash;
+		uint64 buildHash;	// 別のコンパイラ・標準ライブラリで書いたキャッシュを弾く
+		uint32 codeSize;	// 構造体の大きさが違うビルドのキャッシュを弾く
+		uint32 tempoSegmentSize;
+	};
+
+	// ペイロードの配列を 8 バイト境界に置くので、ヘッダーも 8 の倍数にする
+	static_assert(sizeof(Header) % 8 == 0);
+
+	struct PayloadHeader
+	{
+		uint64 endTick;
+		uint32 trackCount;
+		uint32 measureCount;
+		uint32 tempoSegmentCount;
+		uint16 resolution;
+		uint16 reserved;
+	};
+
+	struct TrackHeader
+	{
+		uint32 operationCount;
+		uint32 eventCounts[6];
+		uint8 channel;
+		uint8 program;
+		uint16 reserved;
+	};
+};
+
+// path の SMF を読み込む。cacheDirectory に同じ内容のキャッシュがあればそちらから復元し、無ければ作る
+Optional<MidiData> LoadMidiCached(FilePathView path, FilePathView cacheDirectory, String* errorMessage = nullptr);
 
 MetaEventData MetaEventData::Error()
 {
@@ -374,45 +635,154 @@ MetaEventData MetaEventData::SetTempo(double bpm)
 	return data;
 }
 
-void TrackData::init()
+void TrackData::init(Array<MidiCode>&& operations)
 {
-	HashTable<int, Note> onNotes;
+	auto storage = std::make_shared<Storage>();
+	storage->operations = std::move(operations);
 
-	for (auto& code : m_operations)
+	for (const auto& code : storage->operations)
 	{
 		if (code.type == EventType::MidiEvent)
 		{
-			auto& midiEvent = std::get<MidiEventData>(code.data);
+			const auto& midiEvent = std::get<MidiEventData>(code.data);
 
-			if (auto* pNoteOn = std::get_if<NoteOnEvent>(&midiEvent))
+			if (const auto* pNoteOn = std::get_if<NoteOnEvent>(&midiEvent))
 			{
-				m_noteOnEvents.emplace(code.tick, *pNoteOn);
+				storage->noteOnEvents.emplace_back(code.tick, *pNoteOn);
 			}
-			else if (auto* pNoteOff = std::get_if<NoteOffEvent>(&midiEvent))
+			else if (const auto* pNoteOff = std::get_if<NoteOffEvent>(&midiEvent))
 			{
-				m_noteOffEvents.emplace(code.tick, *pNoteOff);
+				storage->noteOffEvents.emplace_back(code.tick, *pNoteOff);
 			}
-			else if (auto* pPolyphonicKeyPressure = std::get_if<PolyphonicKeyPressureEvent>(&midiEvent))
+			else if (const auto* pPolyphonicKeyPressure = std::get_if<PolyphonicKeyPressureEvent>(&midiEvent))
 			{
-				m_polyphonicKeyPressureEvents.emplace(code.tick, *pPolyphonicKeyPressure);
+				storage->polyphonicKeyPressureEvents.emplace_back(code.tick, *pPolyphonicKeyPressure);
 			}
-			else if (auto* pControlChange = std::get_if<ControlChangeEvent>(&midiEvent))
+			else if (const auto* pControlChange = std::get_if<ControlChangeEvent>(&midiEvent))
 			{
-				m_controlChangeEvent.emplace(code.tick, *pControlChange);
+				storage->controlChangeEvents.emplace_back(code.tick, *pControlChange);
 			}
-			else if (auto* pProgramChange = std::get_if<ProgramChangeEvent>(&midiEvent))
+			else if (const auto* pProgramChange = std::get_if<ProgramChangeEvent>(&midiEvent))
 			{
-				m_programChangeEvent.emplace(code.tick, *pProgramChange);
+				storage->programChangeEvents.emplace_back(code.tick, *pProgramChange);
 				// TODO: 途中でProgramChangeイベントがある場合に対応してない
 				m_channel = pProgramChange->channel;
 				m_program = pProgramChange->type;
 			}
-			else if (auto* pPitchBend = std::get_if<PitchBendEvent>(&midiEvent))
+			else if (const auto* pPitchBend = std::get_if<PitchBendEvent>(&midiEvent))
 			{
-				m_pitchBendEvent.emplace(code.tick, *pPitchBend);
+				storage->pitchBendEvents.emplace_back(code.tick, *pPitchBend);
 			}
 		}
 	}
+
+	// 同じ tick のイベントは読み込み順を保ったまま tick 順に整列する
+	const auto sortByTick = [](auto& eventList)
+	{
+		std::stable_sort(eventList.begin(), eventList.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+	};
+
+	sortByTick(storage->noteOnEvents);
+	sortByTick(storage->noteOffEvents);
+	sortByTick(storage->polyphonicKeyPressureEvents);
+	sortByTick(storage->controlChangeEvents);
+	sortByTick(storage->programChangeEvents);
+	sortByTick(storage->pitchBendEvents);
+
+	m_operations = storage->operations;
+	m_noteOnEvents = storage->noteOnEvents;
+	m_noteOffEvents = storage->noteOffEvents;
+	m_polyphonicKeyPressureEvents = storage->polyphonicKeyPressureEvents;
+	m_controlChangeEvent = storage->controlChangeEvents;
+	m_programChangeEvent = storage->programChangeEvents;
+	m_pitchBendEvent = storage->pitchBendEvents;
+	m_storage = std::move(storage);
+}
+
+TempoMap::TempoMap(const std::map<int64, double>& bpmSetEvents, uint16 resolution)
+{
+	const double resolutionDouble = resolution;
+
+	// テンポ指定が無い区間は BPM120 として扱う
+	const auto makeSegment = [&](int64 tick, double seconds, double bpm)
+	{
+		return TempoSegment{ tick, seconds, bpm, 60.0 / (resolutionDouble * bpm), (resolutionDouble * bpm) / 60.0 };
+	};
+
+	m_segments.reserve(bpmSetEvents.size() + 1);
+	m_segments.push_back(makeSegment(0, 0.0, 120.0));
+
+	for (const auto [tick, bpm] : bpmSetEvents)
+	{
+		const auto& prev = m_segments.back();
+		m_segments.push_back(makeSegment(tick, prev.seconds + prev.secPerTick * (tick - prev.tick), bpm));
+	}
+}
+
+size_t TempoMap::segmentIndexAtTick(double tick) const
+{
+	const auto it = std::upper_bound(m_segments.begin() + 1, m_segments.end(), tick,
+		[](double t, const TempoSegment& segment) { return t < segment.tick; });
+	return static_cast<size_t>(it - m_segments.begin()) - 1;
+}
+
+size_t TempoMap::segmentIndexAtSeconds(double seconds) const
+{
+	const auto it = std::upper_bound(m_segments.begin() + 1, m_segments.end(), seconds,
+		[](double sec, const TempoSegment& segment) { return sec < segment.seconds; });
+	return static_cast<size_t>(it - m_segments.begin()) - 1;
+}
+
+double TempoMap::ticksToSeconds(double tick) const
+{
+	const auto& segment = m_segments[segmentIndexAtTick(tick)];
+	return segment.seconds + segment.secPerTick * (tick - segment.tick);
+}
+
+double TempoMap::secondsToTicks(double seconds) const
+{
+	const auto& segment = m_segments[segmentIndexAtSeconds(seconds)];
+	return segment.tick + (seconds - segment.seconds) * segment.ticksPerSec;
+}
+
+double TempoCursor::ticksToSeconds(double tick)
+{
+	const auto& segments = m_tempoMap->segments();
+
+	if (tick < segments[m_index].tick)
+	{
+		m_index = m_tempoMap->segmentIndexAtTick(tick);
+	}
+	else
+	{
+		while (m_index + 1 < segments.size() && segments[m_index + 1].tick <= tick)
+		{
+			++m_index;
+		}
+	}
+
+	const auto& segment = segments[m_index];
+	return segment.seconds + segment.secPerTick * (tick - segment.tick);
+}
+
+double TempoCursor::secondsToTicks(double seconds)
+{
+	const auto& segments = m_tempoMap->segments();
+
+	if (seconds < segments[m_index].seconds)
+	{
+		m_index = m_tempoMap->segmentIndexAtSeconds(seconds);
+	}
+	else
+	{
+		while (m_index + 1 < segments.size() && segments[m_index + 1].seconds <= seconds)
+		{
+			++m_index;
+		}
+	}
+
+	const auto& segment = segments[m_index];
+	return segment.tick + (seconds - segment.seconds) * segment.ticksPerSec;
 }
 
 void Measure::outputLog() const
@@ -454,7 +824,7 @@ void MidiData::init()
 
 	m_measures.sort_by([](const MeasureInfo& a, const MeasureInfo& b) { return a.globalTick < b.globalTick; });
 
-	m_bpmSetEvents = BPMSetEvents();
+	m_tempoMap = TempoMap(BPMSetEvents(), m_resolution);
 }
 
 Array<Measure> MidiData::getMeasures() const
@@ -534,89 +904,23 @@ double MidiData::getBPM() const
 
 double MidiData::ticksToSeconds(int64 currentTick) const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastTickToSec = 60.0 / (resolution * 120.0);
-	for (const auto [tick, bpm] : m_bpmSetEvents)
-	{
-		if (currentTick <= tick)
-		{
-			return sumOfTime + lastTickToSec * (currentTick - lastBPMSetTick);
-		}
-
-		sumOfTime += lastTickToSec * (tick - lastBPMSetTick);
-		lastBPMSetTick = tick;
-		lastTickToSec = 60.0 / (resolution * bpm);
-	}
-
-	return sumOfTime + lastTickToSec * (currentTick - lastBPMSetTick);
+	return m_tempoMap.ticksToSeconds(static_cast<double>(currentTick));
 }
 
 int64 MidiData::secondsToTicks(double seconds) const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastBPM = 120;
-	for (const auto [tick, bpm] : m_bpmSetEvents)
-	{
-		const double nextSumOfTime = sumOfTime + (60.0 / (resolution * lastBPM)) * (tick - lastBPMSetTick);
-		if (sumOfTime <= seconds && seconds < nextSumOfTime)
-		{
-			const double secToTicks = (resolution * lastBPM) / 60.0;
-			return lastBPMSetTick + static_cast<int64>(Math::Round((seconds - sumOfTime) * secToTicks));
-		}
-
-		sumOfTime = nextSumOfTime;
-		lastBPMSetTick = tick;
-		lastBPM = bpm;
-	}
-
-	const double secToTicks = (resolution * lastBPM) / 60.0;
-	return lastBPMSetTick + static_cast<int64>(Math::Round((seconds - sumOfTime) * secToTicks));
+	const auto& segment = m_tempoMap.segments()[m_tempoMap.segmentIndexAtSeconds(seconds)];
+	return segment.tick + static_cast<int64>(Math::Round((seconds - segment.seconds) * segment.ticksPerSec));
 }
 
 double MidiData::secondsToTicks2(double seconds) const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastBPM = 120;
-	for (const auto [tick, bpm] : m_bpmSetEvents)
-	{
-		const double nextSumOfTime = sumOfTime + (60.0 / (resolution * lastBPM)) * (tick - lastBPMSetTick);
-		if (sumOfTime <= seconds && seconds < nextSumOfTime)
-		{
-			const double secToTicks = (resolution * lastBPM) / 60.0;
-			return lastBPMSetTick + (seconds - sumOfTime) * secToTicks;
-		}
-
-		sumOfTime = nextSumOfTime;
-		lastBPMSetTick = tick;
-		lastBPM = bpm;
-	}
-
-	const double secToTicks = (resolution * lastBPM) / 60.0;
-	return lastBPMSetTick + (seconds - sumOfTime) * secToTicks;
+	return m_tempoMap.secondsToTicks(seconds);
 }
 
 double MidiData::lengthOfTime() const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastBPM = 120;
-	for (const auto [tick, bpm] : m_bpmSetEvents)
-	{
-		const double nextSumOfTime = sumOfTime + (60.0 / (resolution * lastBPM)) * (tick - lastBPMSetTick);
-
-		sumOfTime = nextSumOfTime;
-		lastBPMSetTick = tick;
-		lastBPM = bpm;
-	}
-
-	return sumOfTime + (60.0 / (resolution * lastBPM)) * (m_endTick - lastBPMSetTick);
+	return m_tempoMap.ticksToSeconds(static_cast<double>(m_endTick));
 }
 
 int64 MidiData::lengthSample(uint32 sampleRate) const
@@ -652,283 +956,437 @@ bool MidiData::intersects(uint32 range0begin, uint32 range0end, uint32 range1beg
 	return !notIntersects;
 }
 
-namespace
+MidiEventScheduler::MidiEventScheduler(const MidiData& midiData, uint32 sampleRate)
 {
-	// https://sites.google.com/site/yyagisite/material/smfspec
-	// http://quelque.sakura.ne.jp/midi_meta.html
-	MetaEventData ReadMetaEvent(BinaryReader& reader)
+	// tick から秒への変換の丸め誤差で、ちょうどサンプル位置に来るイベントが ceil で1サンプル遅れないようにする余裕
+	constexpr double SampleEpsilon = 1e-6;
+
+	const auto& tracks = midiData.tracks();
+
+	for (uint32 trackIndex = 0; trackIndex < tracks.size(); ++trackIndex)
 	{
-		const uint8 metaEventType = ReadBytes<uint8>(reader);
-		switch (metaEventType)
-		{
-		case 0x0:
+		for (const auto& code : tracks[trackIndex].m_operations)
 		{
-			Logger << U"error: シーケンス番号（非対応フォーマット）";
-			return MetaEventData::Error();
+			if (code.type != EventType::MidiEvent)
+			{
+				continue;
+			}
+
+			// イベントの時刻以降で最初のサンプルから反映する
+			const double seconds = midiData.ticksToSeconds(code.tick);
+			const auto sampleIndex = static_cast<int64>(ceil(seconds * sampleRate - SampleEpsilon));
+			m_events.push_back(ScheduledMidiEvent{ sampleIndex, trackIndex, std::get<MidiEventData>(code.data) });
 		}
-		case 0x1:
+	}
+
+	// 同じサンプル位置ではトラック順・ノートオフ優先で処理する
+	std::stable_sort(m_events.begin(), m_events.end(), [](const ScheduledMidiEvent& a, const ScheduledMidiEvent& b)
 		{
-			Logger << U"テキストイベント";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x2:
+			if (a.sampleIndex != b.sampleIndex)
+			{
+				return a.sampleIndex < b.sampleIndex;
+			}
+			if (a.trackIndex != b.trackIndex)
+			{
+				return a.trackIndex < b.trackIndex;
+			}
+			return std::holds_alternative<NoteOffEvent>(a.data) && !std::holds_alternative<NoteOffEvent>(b.data);
+		});
+}
+
+void MidiEventScheduler::seek(int64 sampleIndex)
+{
+	const auto it = std::lower_bound(m_events.begin(), m_events.end(), sampleIndex,
+		[](const ScheduledMidiEvent& event, int64 index) { return event.sampleIndex < index; });
+	m_cursor = static_cast<size_t>(it - m_events.begin());
+}
+
+WorkStealingThreadPool::WorkStealingThreadPool(size_t workerCount) :
+	m_queues(std::make_unique<TaskQueue[]>(workerCount + 1))
+{
+	m_workers.reserve(workerCount);
+	for (size_t i = 0; i < workerCount; ++i)
+	{
+		m_workers.emplace_back([this, i] { workerLoop(i + 1); });
+	}
+}
+
+WorkStealingThreadPool::~WorkStealingThreadPool()
+{
+	m_stop.store(true, std::memory_order_release);
+	m_generation.fetch_add(1, std::memory_order_release);
+	m_generation.notify_all();
+
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+Optional<uint32> WorkStealingThreadPool::TaskQueue::popFront()
+{
+	uint64 current = range.load(std::memory_order_acquire);
+	for (;;)
+	{
+		const auto head = static_cast<uint32>(current >> 32);
+		const auto tail = static_cast<uint32>(current);
+		if (tail <= head)
 		{
-			Logger << U"著作権表示";
-			const uint8 length = ReadBytes<uint8>(reader);
-			Array<char> chars(length + 1ull, '\0');
-			reader.read(chars.data(), length);
-			Logger << Unicode::FromUTF8(std::string(chars.data()));
-			return MetaEventData();
+			return none;
 		}
-		case 0x3:
+		if (range.compare_exchange_weak(current, (static_cast<uint64>(head + 1) << 32) | tail, std::memory_order_acq_rel, std::memory_order_acquire))
 		{
-			Logger << U"シーケンス名/トラック名";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+			return head;
 		}
-		case 0x4:
+	}
+}
+
+Optional<uint32> WorkStealingThreadPool::TaskQueue::popBack()
+{
+	uint64 current = range.load(std::memory_order_acquire);
+	for (;;)
+	{
+		const auto head = static_cast<uint32>(current >> 32);
+		const auto tail = static_cast<uint32>(current);
+		if (tail <= head)
 		{
-			Logger << U"楽器名";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+			return none;
 		}
-		case 0x5:
+		if (range.compare_exchange_weak(current, (static_cast<uint64>(head) << 32) | (tail - 1), std::memory_order_acq_rel, std::memory_order_acquire))
 		{
-			Logger << U"歌詞";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+			return tail - 1;
 		}
-		case 0x6:
+	}
+}
+
+void WorkStealingThreadPool::run(size_t taskCount, void* context, TaskFunction function)
+{
+	const size_t queueCount = m_workers.size() + 1;
+
+	m_context = context;
+	m_function = function;
+	m_pendingCount.store(taskCount, std::memory_order_release);
+
+	// 連続したインデックスが同じキューに偏らないように順番に振り分ける
+	for (size_t q = 0; q < queueCount; ++q)
+	{
+		m_queues[q].reset(static_cast<uint32>((taskCount + queueCount - 1 - q) / queueCount));
+	}
+
+	m_generation.fetch_add(1, std::memory_order_release);
+	m_generation.notify_all();
+
+	// 呼び出し元も処理して、取り出せるタスクが無くなったら残りが終わるまで待つ
+	for (;;)
+	{
+		if (processTask(0))
 		{
-			Logger << U"マーカー";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+			continue;
 		}
-		case 0x7:
+
+		const size_t pendingCount = m_pendingCount.load(std::memory_order_acquire);
+		if (pendingCount == 0)
 		{
-			Logger << U"キューポイント";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+			break;
 		}
-		case 0x8:
+		m_pendingCount.wait(pendingCount, std::memory_order_acquire);
+	}
+}
+
+void WorkStealingThreadPool::workerLoop(size_t queueIndex)
+{
+	uint64 generation = 0;
+
+	for (;;)
+	{
+		m_generation.wait(generation, std::memory_order_acquire);
+		if (m_stop.load(std::memory_order_acquire))
 		{
-			Logger << U"プログラム名";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+			return;
 		}
-		case 0x9:
+		generation = m_generation.load(std::memory_order_acquire);
+
+		while (processTask(queueIndex))
 		{
-			Logger << U"デバイス名";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
 		}
-		case 0x20:
-		{
-			Logger << U"MIDIチャンネルプリフィクス";
-			ReadBytes<uint8>(reader);
-			/*const uint8 data =*/ ReadBytes<uint8>(reader);
-			return MetaEventData();
-		}
-		case 0x21:
-		{
-			Logger << U"ポート指定";
-			ReadBytes<uint8>(reader);
-			/*const uint8 data =*/ ReadBytes<uint8>(reader);
-			return MetaEventData();
-		}
-		case 0x2f:
+	}
+}
+
+bool WorkStealingThreadPool::processTask(size_t queueIndex)
+{
+	const size_t queueCount = m_workers.size() + 1;
+
+	Optional<size_t> taskIndex;
+
+	// 自分のキューは先頭から取り出す
+	if (const auto k = m_queues[queueIndex].popFront())
+	{
+		taskIndex = queueIndex + *k * queueCount;
+	}
+
+	// 空なら他のキューの末尾から盗む
+	for (size_t i = 1; !taskIndex && i < queueCount; ++i)
+	{
+		const size_t victim = (queueIndex + i) % queueCount;
+		if (const auto k = m_queues[victim].popBack())
 		{
-			Logger << U"end of track";
-			ReadBytes<uint8>(reader);
-			return MetaEventData::EndOfTrack();
+			taskIndex = victim + *k * queueCount;
 		}
-		case 0x51:
-		{
-			ReadBytes<uint8>(reader);//==3
+	}
 
-			const auto a = ReadBytes<uint8>(reader);
-			const auto b = ReadBytes<uint8>(reader);
-			const auto c = ReadBytes<uint8>(reader);
-			const auto microSecPerBeat = 1.0 * ((a << 16) + (b << 8) + c);
+	if (!taskIndex)
+	{
+		return false;
+	}
 
-			const double bpm = 1.e6 * 60.0 / microSecPerBeat;
-			Logger << U"テンポ: " << bpm;
-			return MetaEventData::SetTempo(bpm);
-		}
-		case 0x54:
+	m_function(m_context, *taskIndex);
+
+	// 最後のタスクを終えたら待っている呼び出し元を起こす
+	if (m_pendingCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		m_pendingCount.notify_all();
+	}
+	return true;
+}
+
+namespace
+{
+	// メモリ上の SMF を先頭から読み進める（範囲外を読もうとしたら false を返す）
+	class SmfReader
+	{
+	public:
+
+		SmfReader(const uint8* begin, const uint8* end) : m_pos(begin), m_end(end) {}
+
+		size_t remaining() const { return static_cast<size_t>(m_end - m_pos); }
+
+		const uint8* pos() const { return m_pos; }
+
+		bool readByte(uint8& value)
 		{
-			Logger << U"SMPTEオフセット";
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			return MetaEventData();
+			if (m_pos == m_end)
+			{
+				return false;
+			}
+			value = *m_pos++;
+			return true;
 		}
-		case 0x58:
+
+		// 次のバイトを読み進めずに返す
+		bool peekByte(uint8& value) const
 		{
-			//https://nekonenene.hatenablog.com/entry/2017/02/26/001351
-			ReadBytes<uint8>(reader);
-			const uint8 numerator = ReadBytes<uint8>(reader);
-			const uint8 denominator = ReadBytes<uint8>(reader);
-			Logger << U"拍子: " << numerator << U"/" << (1 << denominator);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			return MetaEventData::SetMetre(numerator, (1 << denominator));
+			if (m_pos == m_end)
+			{
+				return false;
+			}
+			value = *m_pos;
+			return true;
 		}
-		case 0x59:
+
+		template<class T>
+		bool readBigEndian(T& value)
 		{
-			Logger << U"調号";
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			return MetaEventData();
+			if (remaining() < sizeof(T))
+			{
+				return false;
+			}
+
+			value = 0;
+			for (size_t i = 0; i < sizeof(T); ++i)
+			{
+				value = static_cast<T>((value << 8) | m_pos[i]);
+			}
+			m_pos += sizeof(T);
+			return true;
 		}
-		case 0x7f:
+
+		// 可変長数値（最大4バイト）
+		bool readVariableLength(uint32& value)
 		{
-			Logger << U"シーケンサ固有メタイベント";
-			const uint8 length = ReadBytes<uint8>(reader);
-			Array<uint8> data(length);
-			reader.read(data.data(), length);
-			return MetaEventData();
+			value = 0;
+			for (int i = 0; i < 4; ++i)
+			{
+				uint8 byte;
+				if (!readByte(byte))
+				{
+					return false;
+				}
+
+				value = (value << 7) | (byte & 0x7F);
+				if (byte < 0x80)
+				{
+					return true;
+				}
+			}
+			return false;
 		}
-		default:
-			Logger << U" unknown metaEvent: " << metaEventType;
-			Logger << U" テキストとして解釈します";
-			const auto text = ReadText(reader);
-			Logger << Unicode::FromUTF8(text);
-			return MetaEventData();
+
+		// length バイトをそのまま参照して読み進める
+		bool readSpan(size_t length, std::span<const uint8>& bytes)
+		{
+			if (remaining() < length)
+			{
+				return false;
+			}
+			bytes = std::span<const uint8>(m_pos, length);
+			m_pos += length;
+			return true;
 		}
-	}
-}
 
-Optional<MidiData> LoadMidi(FilePathView path)
-{
-	Logger << U"open \"" << path << U"\"";
-	BinaryReader reader(path);
+	private:
 
-	if (!reader.isOpen())
-	{
-		Logger << U"couldn't open file";
-		return none;
-	}
+		const uint8* m_pos;
+		const uint8* m_end;
+	};
 
-	char mthd[5] = {};
-	reader.read(mthd, 4);
-	if (std::string(mthd) != "MThd")
+	String ToText(std::span<const uint8> bytes)
 	{
-		Logger << U"error: std::string(mthd) != \"MThd\"";
-		return none;
+		return Unicode::FromUTF8(std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
 	}
 
-	const uint32 headerLength = ReadBytes<uint32>(reader);
-	if (headerLength != 6)
+	// https://sites.google.com/site/yyagisite/material/smfspec
+	// http://quelque.sakura.ne.jp/midi_meta.html
+	// 長さを読んでからデータをまとめて取り出すので、知らない種類のメタイベントも読み飛ばせる
+	Optional<MetaEventData> ReadMetaEvent(SmfReader& reader, bool logDiagnostics)
 	{
-		Logger << U"error: headerLength != 6";
-		return none;
-	}
+		uint8 metaEventType;
+		uint32 length;
+		std::span<const uint8> data;
+		if (!reader.readByte(metaEventType) || !reader.readVariableLength(length) || !reader.readSpan(length, data))
+		{
+			return none;
+		}
 
-	const uint16 format = ReadBytes<uint16>(reader);
-	if ((format != 0) && (format != 1))
-	{
-		Logger << U"error: (format != 0) && (format != 1)";
-		return none;
-	}
-	Logger << U"format: " << format;
+		switch (metaEventType)
+		{
+		case 0x2f:
+			if (logDiagnostics)
+			{
+				Logger << U"end of track";
+			}
+			return MetaEventData::EndOfTrack();
+		case 0x51:
+		{
+			if (data.size() < 3)
+			{
+				return MetaEventData::Error();
+			}
 
-	uint16 trackCount = ReadBytes<uint16>(reader);
-	Logger << U"tracks: " << trackCount;
+			const auto microSecPerBeat = 1.0 * ((data[0] << 16) + (data[1] << 8) + data[2]);
 
-	const uint16 resolution = ReadBytes<uint16>(reader);
-	Logger << U"resolution: " << resolution;
+			const double bpm = 1.e6 * 60.0 / microSecPerBeat;
+			if (logDiagnostics)
+			{
+				Logger << U"テンポ: " << bpm;
+			}
+			return MetaEventData::SetTempo(bpm);
+		}
+		case 0x58:
+		{
+			//https://nekonenene.hatenablog.com/entry/2017/02/26/001351
+			if (data.size() < 2)
+			{
+				return MetaEventData::Error();
+			}
 
-	Array<TrackData> tracks;
+			const uint8 numerator = data[0];
+			const uint8 denominator = data[1];
+			if (logDiagnostics)
+			{
+				Logger << U"拍子: " << numerator << U"/" << (1 << denominator);
+			}
+			return MetaEventData::SetMetre(numerator, (1 << denominator));
+		}
+		default:
+			break;
+		}
 
-	for (uint32 trackIndex = 0; trackIndex < trackCount; ++trackIndex)
-	{
-		char mtrk[5] = {};
-		reader.read(mtrk, 4);
-		if (std::string(mtrk) != "MTrk")
+		// 再生に使わないメタイベントは診断出力のときだけ中身を見る
+		if (logDiagnostics)
 		{
-			Logger << U"error: std::string(str) != \"MTrk\"";
-			return none;
+			switch (metaEventType)
+			{
+			case 0x0: Logger << U"シーケンス番号"; break;
+			case 0x1: Logger << U"テキストイベント" << U"\n" << ToText(data); break;
+			case 0x2: Logger << U"著作権表示" << U"\n" << ToText(data); break;
+			case 0x3: Logger << U"シーケンス名/トラック名" << U"\n" << ToText(data); break;
+			case 0x4: Logger << U"楽器名" << U"\n" << ToText(data); break;
+			case 0x5: Logger << U"歌詞" << U"\n" << ToText(data); break;
+			case 0x6: Logger << U"マーカー" << U"\n" << ToText(data); break;
+			case 0x7: Logger << U"キューポイント" << U"\n" << ToText(data); break;
+			case 0x8: Logger << U"プログラム名" << U"\n" << ToText(data); break;
+			case 0x9: Logger << U"デバイス名" << U"\n" << ToText(data); break;
+			case 0x20: Logger << U"MIDIチャンネルプリフィクス"; break;
+			case 0x21: Logger << U"ポート指定"; break;
+			case 0x54: Logger << U"SMPTEオフセット"; break;
+			case 0x59: Logger << U"調号"; break;
+			case 0x7f: Logger << U"シーケンサ固有メタイベント"; break;
+			default: Logger << U" unknown metaEvent: " << metaEventType; break;
+			}
 		}
 
-		uint32 trackBytesLength = ReadBytes<uint32>(reader);
-		Logger << U"trackLength: " << trackBytesLength;
-
-		Array<MidiCode> trackData;
+		return MetaEventData();
+	}
 
+	// 1トラック分のイベントを読み込む（reader はトラックの範囲だけを指す）
+	bool ReadTrack(SmfReader& reader, Array<MidiCode>& trackData, bool logDiagnostics, String& errorMessage)
+	{
 		int64 currentTick = 0;
 		uint8 prevOpCode = 0;
 
-		const int64 trackEndPos = reader.getPos() + trackBytesLength;
-
-		for (;;)
+		while (0 < reader.remaining())
 		{
 			MidiCode codeData;
 
-			Array<uint8> nextTick;
-			for (;;)
+			uint32 step;
+			if (!reader.readVariableLength(step))
 			{
-				uint8 byte = ReadBytes<uint8>(reader);
-				if (byte < 0x80)
-				{
-					nextTick.push_back(byte);
-					break;
-				}
-				else
-				{
-					nextTick.push_back(byte);
-				}
+				errorMessage = U"error: デルタタイムが不正です";
+				return false;
 			}
-
-			if (5 <= nextTick.size())
-			{
-				Logger << U"error: 5 <= nextTick.size()";
-				return none;
-			}
-			const uint32 step = GetTick(nextTick);
 			currentTick += step;
 			codeData.tick = currentTick;
 
-			uint8 opcode = ReadBytes<uint8>(reader);
+			uint8 opcode;
+			if (!reader.peekByte(opcode))
+			{
+				errorMessage = U"error: トラックの途中でデータが終わっています";
+				return false;
+			}
 
-			// ランニングステータス
+			// ランニングステータス（ステータスバイトを省略して直前のものを使う）
 			if (opcode < 0x80)
 			{
 				opcode = prevOpCode;
-				reader.setPos(reader.getPos() - 1);
+			}
+			else
+			{
+				reader.readByte(opcode);
 			}
 
 			prevOpCode = opcode;
 
+			// チャンネルメッセージのデータバイト
+			const auto readData = [&](uint8& value) { return reader.readByte(value); };
+
+			bool succeeded = true;
+			const uint8 channelIndex = opcode & 0x0F;
+
 			// https://sites.google.com/site/yyagisite/material/smfspec
-			if (0x80 <= opcode && opcode <= 0x8F)
+			switch (opcode & 0xF0)
+			{
+			case 0x80:
 			{
-				//Logger << U"ノートオフ";
-				const uint8 channelIndex = opcode - 0x80;
-				const uint8 key = ReadBytes<uint8>(reader);
-				ReadBytes<uint8>(reader);
+				uint8 key = 0, velocity = 0;
+				succeeded = readData(key) && readData(velocity);
 				codeData.type = EventType::MidiEvent;
 				codeData.data = MidiEventData(NoteOffEvent(channelIndex, key));
+				break;
 			}
-			else if (0x90 <= opcode && opcode <= 0x9F)
+			case 0x90:
 			{
-				//Logger << U"ノートオン";
-				const uint8 channelIndex = opcode - 0x90;
-				const uint8 key = ReadBytes<uint8>(reader);
-				const uint8 velocity = ReadBytes<uint8>(reader);
+				uint8 key = 0, velocity = 0;
+				succeeded = readData(key) && readData(velocity);
 				codeData.type = EventType::MidiEvent;
 				if (velocity == 0)
 				{
@@ -938,93 +1396,589 @@ Optional<MidiData> LoadMidi(FilePathView path)
 				{
 					codeData.data = MidiEventData(NoteOnEvent(channelIndex, key, velocity));
 				}
+				break;
 			}
-			else if (0xA0 <= opcode && opcode <= 0xAF)
+			case 0xA0:
 			{
-				//Logger << U"ポリフォニックキープレッシャー";
-				const uint8 channelIndex = opcode - 0xA0;
-				const uint8 key = ReadBytes<uint8>(reader);
-				const uint8 velocity = ReadBytes<uint8>(reader);
+				uint8 key = 0, velocity = 0;
+				succeeded = readData(key) && readData(velocity);
 				codeData.type = EventType::MidiEvent;
 				codeData.data = MidiEventData(PolyphonicKeyPressureEvent(channelIndex, key, velocity));
+				break;
 			}
-			else if (0xB0 <= opcode && opcode <= 0xBF)
+			case 0xB0:
 			{
-				const uint8 channelIndex = opcode - 0xB0;
-				const uint8 changeType = ReadBytes<uint8>(reader);
-				const uint8 controlChangeData = ReadBytes<uint8>(reader);
-				//Logger << U"コントロールチェンジ " << changeType;
+				uint8 changeType = 0, controlChangeData = 0;
+				succeeded = readData(changeType) && readData(controlChangeData);
 				codeData.type = EventType::MidiEvent;
 				codeData.data = MidiEventData(ControlChangeEvent(channelIndex, changeType, controlChangeData));
+				break;
 			}
-			else if (0xC0 <= opcode && opcode <= 0xCF)
+			case 0xC0:
 			{
-				//Logger << U"プログラムチェンジ";
-				const uint8 channelIndex = opcode - 0xC0;
-				const uint8 programNumber = ReadBytes<uint8>(reader);
+				uint8 programNumber = 0;
+				succeeded = readData(programNumber);
 				codeData.type = EventType::MidiEvent;
 				codeData.data = MidiEventData(ProgramChangeEvent(channelIndex, programNumber));
+				break;
 			}
-			else if (0xD0 <= opcode && opcode <= 0xDF)
+			case 0xD0:
 			{
-				//Logger << U"チャンネルプレッシャー";
-				const uint8 channelIndex = opcode - 0xD0;
-				const uint8 velocity = ReadBytes<uint8>(reader);
+				uint8 velocity = 0;
+				succeeded = readData(velocity);
 				codeData.type = EventType::MidiEvent;
 				codeData.data = MidiEventData(ChannelPressureEvent(channelIndex, velocity));
+				break;
 			}
-			else if (0xE0 <= opcode && opcode <= 0xEF)
+			case 0xE0:
 			{
-				//Logger << U"ピッチベンド";
-				const uint8 channelIndex = opcode - 0xE0;
-				const uint8 m = ReadBytes<uint8>(reader);
-				const uint8 l = ReadBytes<uint8>(reader);
+				uint8 m = 0, l = 0;
+				succeeded = readData(m) && readData(l);
 				const uint16 value = ((l & 0x7F) << 7) + (m & 0x7F);
 				codeData.type = EventType::MidiEvent;
 				codeData.data = MidiEventData(PitchBendEvent(channelIndex, value));
+				break;
 			}
-			else if (0xF0 == opcode)
+			default:
 			{
-				//Logger << U"SysEx イベント";
-				codeData.type = EventType::SysExEvent;
-				while (ReadBytes<uint8>(reader) != 0xF7) {}
+				if (opcode == 0xF0 || opcode == 0xF7)
+				{
+					// SysEx イベントは長さの分だけ読み飛ばす
+					uint32 length;
+					std::span<const uint8> data;
+					succeeded = reader.readVariableLength(length) && reader.readSpan(length, data);
+					codeData.type = EventType::SysExEvent;
+				}
+				else if (opcode == 0xFF)
+				{
+					const auto result = ReadMetaEvent(reader, logDiagnostics);
+					if (!result || result->isError())
+					{
+						errorMessage = U"error: メタイベントが不正です";
+						return false;
+					}
+
+					codeData.type = EventType::MetaEvent;
+					codeData.data = result.value();
+
+					if (result->isEndOfTrack())
+					{
+						trackData.push_back(codeData);
+						return true;
+					}
+				}
+				else
+				{
+					errorMessage = U"error: unknown opcode: {}"_fmt(opcode);
+					return false;
+				}
+				break;
 			}
-			else if (0xF7 == opcode)
+			}
+
+			if (!succeeded)
 			{
-				Logger << U"error: SysEx イベント（非対応フォーマット）";
-				return none;
+				errorMessage = U"error: トラックの途中でデータが終わっています";
+				return false;
+			}
+
+			trackData.push_back(codeData);
+		}
+
+		// end of track が無いまま終わったトラックもそのまま使う
+		return true;
+	}
+}
+
+Optional<MidiData> LoadMidiFromMemory(std::span<const uint8> bytes, bool logDiagnostics, String* errorMessage)
+{
+	SmfReader reader(bytes.data(), bytes.data() + bytes.size());
+
+	const auto fail = [&](const String& message) -> Optional<MidiData>
+	{
+		if (logDiagnostics)
+		{
+			Logger << message;
+		}
+		if (errorMessage)
+		{
+			*errorMessage = message;
+		}
+		return none;
+	};
+
+	std::span<const uint8> chunkType;
+	uint32 headerLength;
+	if (!reader.readSpan(4, chunkType) || std::memcmp(chunkType.data(), "MThd", 4) != 0)
+	{
+		return fail(U"error: std::string(mthd) != \"MThd\"");
+	}
+
+	if (!reader.readBigEndian(headerLength) || headerLength != 6)
+	{
+		return fail(U"error: headerLength != 6");
+	}
+
+	uint16 format, trackCount, resolution;
+	if (!reader.readBigEndian(format) || !reader.readBigEndian(trackCount) || !reader.readBigEndian(resolution))
+	{
+		return fail(U"error: ヘッダーが途中で終わっています");
+	}
+
+	if ((format != 0) && (format != 1))
+	{
+		return fail(U"error: (format != 0) && (format != 1)");
+	}
+
+	if (logDiagnostics)
+	{
+		Logger << U"format: " << format;
+		Logger << U"tracks: " << trackCount;
+		Logger << U"resolution: " << resolution;
+	}
+
+	Array<TrackData> tracks;
+	tracks.reserve(trackCount);
+
+	for (uint32 trackIndex = 0; trackIndex < trackCount; ++trackIndex)
+	{
+		uint32 trackBytesLength;
+		if (!reader.readSpan(4, chunkType) || std::memcmp(chunkType.data(), "MTrk", 4) != 0)
+		{
+			return fail(U"error: std::string(str) != \"MTrk\"");
+		}
+
+		std::span<const uint8> trackBytes;
+		if (!reader.readBigEndian(trackBytesLength) || !reader.readSpan(trackBytesLength, trackBytes))
+		{
+			return fail(U"error: トラックの長さがファイルの大きさを超えています");
+		}
+
+		if (logDiagnostics)
+		{
+			Logger << U"trackLength: " << trackBytesLength;
+		}
+
+		// 1イベントは最低でも3バイト程度なので、その数だけ確保しておく
+		Array<MidiCode> trackData;
+		trackData.reserve(trackBytesLength / 3);
+
+		SmfReader trackReader(trackBytes.data(), trackBytes.data() + trackBytes.size());
+		String trackError;
+		if (!ReadTrack(trackReader, trackData, logDiagnostics, trackError))
+		{
+			return fail(U"{} (track {})"_fmt(trackError, trackIndex));
+		}
+
+		// 多めに確保した分は読み込んだ MidiData が持ち続けるので、実際のイベント数に合わせて解放する
+		trackData.shrink_to_fit();
+
+		tracks.emplace_back(std::move(trackData));
+	}
+
+	MidiData midiData(std::move(tracks), resolution);
+	if (logDiagnostics)
+	{
+		Logger << U"read succeeded";
+	}
+
+	return midiData;
+}
+
+Optional<MidiData> LoadMidi(FilePathView path, bool logDiagnostics, String* errorMessage)
+{
+	if (logDiagnostics)
+	{
+		Logger << U"open \"" << path << U"\"";
+	}
+
+	MemoryMappedFileView file(path);
+	if (!file)
+	{
+		if (logDiagnostics)
+		{
+			Logger << U"couldn't open file";
+		}
+		if (errorMessage)
+		{
+			*errorMessage = U"couldn't open file";
+		}
+		return none;
+	}
+
+	const auto mapped = file.mapAll();
+	return LoadMidiFromMemory(std::span<const uint8>(reinterpret_cast<const uint8*>(mapped.data), mapped.size), logDiagnostics, errorMessage);
+}
+
+Array<MidiLoadResult> LoadMidiFiles(const Array<FilePath>& paths, size_t threadCount, const Optional<FilePath>& cacheDirectory)
+{
+	Array<MidiLoadResult> results(paths.size());
+
+	// ファイルごとに大きさが違うので、手が空いたスレッドが残りを盗んで処理する
+	WorkStealingThreadPool threadPool(Max<size_t>(threadCount, 1) - 1);
+	threadPool.parallelFor(paths.size(), [&](size_t i)
+		{
+			auto& result = results[i];
+			result.path = paths[i];
+			result.fileSize = FileSystem::FileSize(paths[i]);
+			result.midiData = cacheDirectory
+				? LoadMidiCached(paths[i], cacheDirectory.value(), &result.errorMessage)
+				: LoadMidi(paths[i], false, &result.errorMessage);
+		});
+
+	return results;
+}
+
+namespace
+{
+	// from を to に移して、to が既にあれば置き換える
+	// POSIX では rename なので不可分に置き換わるが、Windows では MOVEFILE_REPLACE_EXISTING での移動になり、
+	// 不可分とは限らず、to を他のプロセスが開いていると失敗する
+	bool ReplaceFile(FilePathView from, FilePathView to)
+	{
+		std::error_code error;
+		std::filesystem::rename(std::filesystem::path(Unicode::ToWstring(from)), std::filesystem::path(Unicode::ToWstring(to)), error);
+		return !error;
+	}
+
+	// 要素の並びを 8 バイト境界から書き込む
+	class CacheWriter
+	{
+	public:
+
+		explicit CacheWriter(Array<uint8>& bytes) : m_bytes(bytes) {}
+
+		template<class T>
+		void write(const T& value)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+			const auto* p = reinterpret_cast<const uint8*>(&value);
+			m_bytes.insert(m_bytes.end(), p, p + sizeof(T));
+		}
+
+		// 読み込み側でバイト列を直接参照するので、メモリ上の表現をそのまま書き出せる型に限る
+		template<class T>
+		void writeArray(const T* data, size_t count)
+		{
+			static_assert(std::is_trivially_copy_constructible_v<T> && std::is_trivially_destructible_v<T> && alignof(T) <= 8);
+			m_bytes.resize((m_bytes.size() + 7) & ~size_t(7), 0);
+			const auto* p = reinterpret_cast<const uint8*>(data);
+			m_bytes.insert(m_bytes.end(), p, p + sizeof(T) * count);
+		}
+
+	private:
+
+		Array<uint8>& m_bytes;
+	};
+
+	class CacheReader
+	{
+	public:
+
+		explicit CacheReader(std::span<const uint8> bytes) : m_bytes(bytes) {}
+
+		template<class T>
+		bool read(T& value)
+		{
+			if (m_bytes.size() - m_pos < sizeof(T))
+			{
+				return false;
 			}
-			else if (0xFF == opcode)
+			std::memcpy(&value, m_bytes.data() + m_pos, sizeof(T));
+			m_pos += sizeof(T);
+			return true;
+		}
+
+		// count 個の要素の先頭を返す（足りなければ nullptr）
+		template<class T>
+		const uint8* readArray(size_t count)
+		{
+			m_pos = Min((m_pos + 7) & ~size_t(7), m_bytes.size());
+			if ((m_bytes.size() - m_pos) / sizeof(T) < count)
 			{
-				const auto result = ReadMetaEvent(reader);
-				codeData.type = EventType::MetaEvent;
-				codeData.data = result;
+				return nullptr;
+			}
+			const auto* p = m_bytes.data() + m_pos;
+			m_pos += sizeof(T) * count;
+			return p;
+		}
 
-				if (result.isEndOfTrack())
-				{
-					trackData.push_back(codeData);
-					reader.setPos(trackEndPos);
-					break;
-				}
-				else if (result.isError())
-				{
-					return none;
-				}
+		// コピーせずにバイト列を直接参照する（バイト列の先頭は 8 バイト境界にあること）
+		template<class T>
+		bool viewArray(std::span<const T>& values, size_t count)
+		{
+			static_assert(alignof(T) <= 8);
+			const auto* p = readArray<T>(count);
+			if (!p)
+			{
+				return false;
 			}
-			else
+			values = std::span<const T>(std::launder(reinterpret_cast<const T*>(p)), count);
+			return true;
+		}
+
+		template<class T>
+		bool readArray(Array<T>& values, size_t count)
+		{
+			const auto* p = readArray<T>(count);
+			if (!p)
+			{
+				return false;
+			}
+			values.resize(count);
+			std::memcpy(values.data(), p, sizeof(T) * count);
+			return true;
+		}
+
+		bool atEnd() const { return m_pos == m_bytes.size(); }
+
+	private:
+
+		std::span<const uint8> m_bytes;
+		size_t m_pos = 0;
+	};
+}
+
+uint64 MidiDataCache::SourceHash(std::span<const uint8> smfBytes)
+{
+	return Hash::XXHash3(smfBytes.data(), smfBytes.size());
+}
+
+uint64 MidiDataCache::BuildHash()
+{
+	static const uint64 buildHash = []
+	{
+		std::string identity;
+#if defined(_MSC_FULL_VER)
+		identity += "msvc " + std::to_string(_MSC_FULL_VER) + ";";
+#endif
+#if defined(_MSVC_STL_UPDATE)
+		identity += "msvc-stl " + std::to_string(_MSVC_STL_UPDATE) + ";";
+#endif
+#if defined(_ITERATOR_DEBUG_LEVEL)
+		identity += "iterator-debug " + std::to_string(_ITERATOR_DEBUG_LEVEL) + ";";
+#endif
+#if defined(__VERSION__)
+		identity += std::string(__VERSION__) + ";";
+#endif
+#if defined(__GLIBCXX__)
+		identity += "libstdc++ " + std::to_string(__GLIBCXX__) + ";";
+#endif
+#if defined(_LIBCPP_VERSION)
+		identity += "libc++ " + std::to_string(_LIBCPP_VERSION) + ";";
+#endif
+		identity += "pointer " + std::to_string(sizeof(void*));
+		return Hash::XXHash3(identity.data(), identity.size());
+	}();
+	return buildHash;
+}
+
+Array<uint8> MidiDataCache::Serialize(const MidiData& midiData, uint64 sourceHash)
+{
+	Array<uint8> payload;
+	CacheWriter writer(payload);
+
+	PayloadHeader payloadHeader = {};
+	payloadHeader.endTick = midiData.m_endTick;
+	payloadHeader.trackCount = static_cast<uint32>(midiData.m_tracks.size());
+	payloadHeader.measureCount = static_cast<uint32>(midiData.m_measures.size());
+	payloadHeader.tempoSegmentCount = static_cast<uint32>(midiData.m_tempoMap.m_segments.size());
+	payloadHeader.resolution = midiData.m_resolution;
+	writer.write(payloadHeader);
+
+	writer.writeArray(midiData.m_measures.data(), midiData.m_measures.size());
+	writer.writeArray(midiData.m_tempoMap.m_segments.data(), midiData.m_tempoMap.m_segments.size());
+
+	const auto writeEvents = [&](const auto& eventList)
+	{
+		writer.writeArray(eventList.data(), eventList.size());
+	};
+
+	for (const auto& track : midiData.m_tracks)
+	{
+		TrackHeader trackHeader = {};
+		trackHeader.operationCount = static_cast<uint32>(track.m_operations.size());
+		trackHeader.eventCounts[0] = static_cast<uint32>(track.m_noteOnEvents.size());
+		trackHeader.eventCounts[1] = static_cast<uint32>(track.m_noteOffEvents.size());
+		trackHeader.eventCounts[2] = static_cast<uint32>(track.m_polyphonicKeyPressureEvents.size());
+		trackHeader.eventCounts[3] = static_cast<uint32>(track.m_controlChangeEvent.size());
+		trackHeader.eventCounts[4] = static_cast<uint32>(track.m_programChangeEvent.size());
+		trackHeader.eventCounts[5] = static_cast<uint32>(track.m_pitchBendEvent.size());
+		trackHeader.channel = track.m_channel;
+		trackHeader.program = track.m_program;
+		writer.write(trackHeader);
+
+		writeEvents(track.m_operations);
+		writeEvents(track.m_noteOnEvents);
+		writeEvents(track.m_noteOffEvents);
+		writeEvents(track.m_polyphonicKeyPressureEvents);
+		writeEvents(track.m_controlChangeEvent);
+		writeEvents(track.m_programChangeEvent);
+		writeEvents(track.m_pitchBendEvent);
+	}
+
+	Header header = {};
+	std::memcpy(header.magic, "SMFC", 4);
+	header.version = Version;
+	header.sourceHash = sourceHash;
+	header.payloadSize = payload.size();
+	header.payloadHash = Hash::XXHash3(payload.data(), payload.size());
+	header.codeSize = sizeof(MidiCode);
+	header.buildHash = BuildHash();
+	header.tempoSegmentSize = sizeof(TempoSegment);
+
+	Array<uint8> bytes;
+	bytes.reserve(sizeof(Header) + payload.size());
+	CacheWriter(bytes).write(header);
+	bytes.insert(bytes.end(), payload.begin(), payload.end());
+	return bytes;
+}
+
+Optional<MidiData> MidiDataCache::Deserialize(std::span<const uint8> bytes, uint64 sourceHash, std::shared_ptr<const void> storage)
+{
+	CacheReader headerReader(bytes);
+
+	Header header;
+	if (!headerReader.read(header)
+		|| std::memcmp(header.magic, "SMFC", 4) != 0
+		|| header.version != Version
+		|| header.sourceHash != sourceHash
+		|| header.codeSize != sizeof(MidiCode)
+		|| header.buildHash != BuildHash()
+		|| header.tempoSegmentSize != sizeof(TempoSegment)
+		|| header.payloadSize != bytes.size() - sizeof(Header))
+	{
+		return none;
+	}
+
+	const auto payload = bytes.subspan(sizeof(Header));
+	if (Hash::XXHash3(payload.data(), payload.size()) != header.payloadHash)
+	{
+		return none;
+	}
+
+	CacheReader reader(payload);
+
+	PayloadHeader payloadHeader;
+	if (!reader.read(payloadHeader))
+	{
+		return none;
+	}
+
+	MidiData midiData;
+	midiData.m_resolution = payloadHeader.resolution;
+	midiData.m_endTick = payloadHeader.endTick;
+
+	if (!reader.readArray(midiData.m_measures, payloadHeader.measureCount)
+		|| !reader.readArray(midiData.m_tempoMap.m_segments, payloadHeader.tempoSegmentCount))
+	{
+		return none;
+	}
+
+	midiData.m_tracks.reserve(payloadHeader.trackCount);
+	for (uint32 trackIndex = 0; trackIndex < payloadHeader.trackCount; ++trackIndex)
+	{
+		TrackHeader trackHeader;
+		if (!reader.read(trackHeader))
+		{
+			return none;
+		}
+
+		TrackData track;
+		track.m_storage = storage;
+		track.m_channel = trackHeader.channel;
+		track.m_program = trackHeader.program;
+
+		if (!reader.viewArray(track.m_operations, trackHeader.operationCount)
+			|| !reader.viewArray(track.m_noteOnEvents, trackHeader.eventCounts[0])
+			|| !reader.viewArray(track.m_noteOffEvents, trackHeader.eventCounts[1])
+			|| !reader.viewArray(track.m_polyphonicKeyPressureEvents, trackHeader.eventCounts[2])
+			|| !reader.viewArray(track.m_controlChangeEvent, trackHeader.eventCounts[3])
+			|| !reader.viewArray(track.m_programChangeEvent, trackHeader.eventCounts[4])
+			|| !reader.viewArray(track.m_pitchBendEvent, trackHeader.eventCounts[5]))
+		{
+			return none;
+		}
+
+		// variant の添字が範囲外だと後で std::get が壊れるので、ここで弾いておく
+		for (const auto& code : track.m_operations)
+		{
+			if (EventType::MetaEvent < code.type
+				|| std::variant_size_v<decltype(code.data)> <= code.data.index()
+				|| (code.data.index() == 0 && std::variant_size_v<MidiEventData> <= std::get<0>(code.data).index()))
 			{
-				Logger << U" unknown opcode: " << opcode;
 				return none;
 			}
+		}
 
-			trackData.push_back(codeData);
+		midiData.m_tracks.push_back(std::move(track));
+	}
+
+	if (!reader.atEnd())
+	{
+		return none;
+	}
+
+	return midiData;
+}
+
+Optional<MidiData> LoadMidiCached(FilePathView path, FilePathView cacheDirectory, String* errorMessage)
+{
+	MemoryMappedFileView file(path);
+	if (!file)
+	{
+		if (errorMessage)
+		{
+			*errorMessage = U"couldn't open file";
 		}
+		return none;
+	}
 
-		tracks.emplace_back(trackData);
+	const auto mapped = file.mapAll();
+	const std::span<const uint8> smfBytes(reinterpret_cast<const uint8*>(mapped.data), mapped.size);
+
+	// ファイル名にハッシュを使うので、内容が変わればキャッシュも別になる
+	const uint64 sourceHash = MidiDataCache::SourceHash(smfBytes);
+	const FilePath cachePath = U"{}/{:016X}.smfcache"_fmt(cacheDirectory, sourceHash);
+
+	if (FileSystem::Exists(cachePath))
+	{
+		// 復元した MidiData がマップしたままのキャッシュを参照するので、ファイルは MidiData と一緒に保持する
+		auto cacheFile = std::make_shared<MemoryMappedFileView>(cachePath);
+		if (*cacheFile)
+		{
+			const auto mappedCache = cacheFile->mapAll();
+			const std::span<const uint8> cacheBytes(reinterpret_cast<const uint8*>(mappedCache.data), mappedCache.size);
+			if (auto midiData = MidiDataCache::Deserialize(cacheBytes, sourceHash, cacheFile))
+			{
+				return midiData;
+			}
+		}
 	}
 
-	MidiData midiData(tracks, resolution);
-	Logger << U"read succeeded";
+	// キャッシュが無いか壊れていれば SMF を読み込んで作り直す
+	auto midiData = LoadMidiFromMemory(smfBytes, false, errorMessage);
+	if (midiData)
+	{
+		const auto bytes = MidiDataCache::Serialize(midiData.value(), sourceHash);
+
+		// 書きかけのキャッシュを他のスレッドやプロセスが読まないように、一時ファイルに書いてから古いキャッシュの上に移す
+		// （キャッシュが無い瞬間を作らないように、古いキャッシュは先に消さない）
+		FileSystem::CreateDirectories(cacheDirectory);
+		const FilePath temporaryPath = U"{}.{:016X}.tmp"_fmt(cachePath, RandomUint64());
+
+		bool written = false;
+		{
+			BinaryWriter writer(temporaryPath);
+			written = writer && (writer.write(bytes.data(), bytes.size()) == static_cast<int64>(bytes.size()));
+		}
+
+		// 置き換えられなかったとき（Windows で他のプロセスが古いキャッシュを開いているときなど）は古いキャッシュを残し、次回また作り直す
+		if (!written || !ReplaceFile(temporaryPath, cachePath))
+		{
+			FileSystem::Remove(temporaryPath);
+		}
+	}
 
 	return midiData;
 }